@@ -9,6 +9,7 @@
 #include "train.h"
 #include "test.h"
 #include "schedule.h"
+#include "subaggregate.h"
 
 using namespace std;
 
@@ -16,9 +17,15 @@ int main(int argc, char** argv)
 {
   int size, rank, retcode;
 
-  // Initialize the MPI environment
-  if (MPI_Init(&argc, &argv))
-    throw runtime_error("comm size query fail");
+  // Initialize the MPI environment. Training ranks may run several worker
+  // threads, but only the main thread makes MPI calls.
+  int provided;
+
+  if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided))
+    throw runtime_error("mpi init fail");
+
+  if (provided < MPI_THREAD_FUNNELED)
+    throw runtime_error("mpi does not support threads");
 
   // Check the number of processes
   if (MPI_Comm_size(MPI_COMM_WORLD, &size))
@@ -68,23 +75,64 @@ int main(int argc, char** argv)
     return -1;
   }
 
+  if (args.preprocess == "fused")
+  {
+    config.preprocess = PREPROCESS_FUSED;
+  } else if (args.preprocess == "opencv") {
+    config.preprocess = PREPROCESS_OPENCV;
+  } else if (args.preprocess == "palette") {
+    config.preprocess = PREPROCESS_PALETTE;
+  } else {
+    if (rank == 0)
+      std::cerr << "Unknown preprocessing backend: " << args.preprocess << std::endl;
+
+    return -1;
+  }
+
+  config.max_pool = args.max_pool;
+
+  if (args.model_transport != "p2p" && args.model_transport != "shared")
+  {
+    if (rank == 0)
+      std::cerr << "Unknown model transport: " << args.model_transport << std::endl;
+
+    return -1;
+  }
+
+  // Ranks 1 .. test_ranks evaluate, and at least one rank must train.
+  if (args.test_ranks < 1 || args.test_ranks + 1 >= size)
+  {
+    if (rank == 0)
+      std::cerr << "Need 1 to " << size - 2 << " tester ranks, got " << args.test_ranks << std::endl;
+
+    return -1;
+  }
+
+  AggregationTree tree = make_aggregation_tree(size, args.test_ranks, args.sub_aggregators);
+
   // If we are the master process, start the scheduler loop.
   if (rank == 0)
   {
       // Start the scheduler loop.
-      retcode = schedule(rank, size, args, rom_path, config);
+      retcode = schedule(rank, size, args, rom_path, config, tree);
   }
 
-  // If we are the secondary process, start the testing loop.
-  else if (rank == 1)
+  // If we are a tester process, start the testing loop.
+  else if (rank <= args.test_ranks)
   {
       // Start the testing loop.
       retcode = test(rank, size, args, rom_path, config);
   }
 
+  // One training rank per remote node sums its node's updates.
+  else if (tree.is_sub_aggregator(rank))
+  {
+      retcode = sub_aggregate(rank, size, args, rom_path, config, tree);
+  }
+
   // Otherwise, start parallel training loops.
   else {
-    retcode = train(rank, size, args, rom_path, config);
+    retcode = train(rank, size, args, rom_path, config, tree);
   }
 
   // Finalize the MPI environment.
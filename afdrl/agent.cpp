@@ -1,29 +1,132 @@
 #include "agent.h"
+#include "log.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
 #include <torch/serialize.h>
 
 using namespace std;
 
+/**
+ * Serializes environments, their episode statistics and the hidden states
+ * of an agent (see AgentStateHeader).
+ */
+static std::vector<char> pack_state(const std::vector<AtariEnv*>& envs, const int* eps_len, const float* eps_reward,
+    const torch::Tensor& hx, const torch::Tensor& cx, bool done)
+{
+  torch::Tensor h = hx.detach().to(torch::kCPU, torch::kFloat32).contiguous();
+  torch::Tensor c = cx.detach().to(torch::kCPU, torch::kFloat32).contiguous();
+
+  std::vector<std::vector<char>> env_states;
+  size_t size = sizeof(AgentStateHeader) + (h.nbytes() + c.nbytes());
+
+  for (AtariEnv* env : envs)
+  {
+    env_states.push_back(env->serialize());
+    size += sizeof(AgentEnvRecord) + env_states.back().size();
+  }
+
+  std::vector<char> buffer(size);
+  char* out = buffer.data();
+
+  AgentStateHeader header;
+  header.magic = AGENT_WIRE_MAGIC;
+  header.envs = envs.size();
+  header.hidden = h.size(1);
+  header.done = done;
+
+  memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+
+  for (size_t i = 0; i < envs.size(); i++)
+  {
+    AgentEnvRecord record;
+    record.eps_len = eps_len[i];
+    record.eps_reward = eps_reward[i];
+    record.bytes = env_states[i].size();
+
+    memcpy(out, &record, sizeof(record));
+    out += sizeof(record);
+
+    memcpy(out, env_states[i].data(), record.bytes);
+    out += record.bytes;
+  }
+
+  memcpy(out, h.data_ptr(), h.nbytes());
+  out += h.nbytes();
+  memcpy(out, c.data_ptr(), c.nbytes());
+
+  return buffer;
+}
+
+/**
+ * Restores what pack_state() wrote. The hidden states keep the device and
+ * shape of hx and cx.
+ *
+ * @return bool The done flag.
+ */
+static bool unpack_state(const char* data, size_t size, const std::vector<AtariEnv*>& envs, int* eps_len, float* eps_reward,
+    torch::Tensor& hx, torch::Tensor& cx)
+{
+  const char* end = data + size;
+
+  AgentStateHeader header;
+
+  if (size < sizeof(header))
+    throw runtime_error("agent state too small");
+
+  memcpy(&header, data, sizeof(header));
+  data += sizeof(header);
+
+  if (header.magic != AGENT_WIRE_MAGIC)
+    throw runtime_error("bad agent state magic");
+  if (header.envs != envs.size() || (int64_t) header.hidden != hx.size(1))
+    throw runtime_error("agent state shape mismatch");
+
+  for (size_t i = 0; i < envs.size(); i++)
+  {
+    AgentEnvRecord record;
+
+    if ((size_t) (end - data) < sizeof(record))
+      throw runtime_error("agent state truncated");
+
+    memcpy(&record, data, sizeof(record));
+    data += sizeof(record);
+
+    if ((size_t) (end - data) < record.bytes)
+      throw runtime_error("agent state truncated");
+
+    envs[i]->deserialize(data, record.bytes);
+    data += record.bytes;
+
+    eps_len[i] = record.eps_len;
+    eps_reward[i] = record.eps_reward;
+  }
+
+  int64_t hidden_bytes = (int64_t) header.envs * header.hidden * sizeof(float);
+
+  if (end - data != 2 * hidden_bytes)
+    throw runtime_error("agent state size mismatch");
+
+  std::vector<int64_t> shape = {header.envs, header.hidden};
+
+  hx = torch::from_blob(const_cast<char*>(data), shape, torch::kFloat32).to(hx.device(), torch::kFloat32, false, true);
+  cx = torch::from_blob(const_cast<char*>(data + hidden_bytes), shape, torch::kFloat32).to(cx.device(), torch::kFloat32, false, true);
+
+  return header.done;
+}
+
 Agent::Agent(LSTMModel& model, AtariEnv& env, Args args)
   : model(model), env(env), args(args) {
   state = env.reset();
 }
 
-void Agent::action_test()
+void Agent::action_train()
 {
   auto st = state.unsqueeze(0);
 
-  // If the environment is done, reset the cx and hx tensors to 0.
-  if (done)
-  {
-    hx = torch::zeros({1, 512}, torch::requires_grad());
-    cx = torch::zeros({1, 512}, torch::requires_grad());
-  } else {
-    hx = hx.detach();
-    cx = cx.detach();
-  }
-
   // If the gpu ID is set, move the hx and cx tensors to the gpu.
   if (args.gpu_id >= 0)
   {
@@ -33,7 +136,7 @@ void Agent::action_test()
   }
 
   // Get the value, logit, and (hx, cx) tensors from the model.
-  auto output = model.forward(torch::TensorList({st, hx, cx})).toTensorList();
+  auto output = model.forward(torch::TensorList({LSTMModel::input(st), hx, cx})).toTensorList();
 
   // Get the value, logit, and new (hx, cx) tensors from the output.
   auto value = output.get(0);
@@ -41,22 +144,39 @@ void Agent::action_test()
   hx = output.get(2);
   cx = output.get(3);
 
+  values.push_back(value);
+
   // Get the probability distribution from the logit tensor.
   auto prob = torch::softmax(logit, 1);
-  
-  // Get the greedy action from the probability distribution.
-  int action = torch::argmax(prob, 1).item<int64_t>();
+  auto log_prob = torch::log_softmax(logit, 1);
 
-  //std::cerr << "policy " << prob << " action " << action << std::endl;
+  // Get the entropy from the prob and log_prob tensors.
+  auto entropy = -(prob * log_prob).sum(1);
+  entropies.push_back(entropy);
+
+  auto action = prob.multinomial(1).data();
+
+  //std::cout << "action " << action.item<int>() << " value " << value.item<float>() << " reward " << reward << " entropy " << entropy.item<float>() << "\n";
+
+  //std::cerr << "policy " << prob << " action " << action <<  " entropy " << entropy << std::endl;
+  //std::cerr << "policy " << prob.toString() << std::endl;
 
+  log_prob = log_prob.gather(1, action);
+  log_probs.push_back(log_prob);
+  
+  // Sample an action from the probability distribution.
   // Step the environment
-  auto result = env.step(action);
+  auto result = env.step(action.item().toInt());
 
   // Get the new state, reward, and done tensors from the result.
   state = std::get<0>(result);
   reward = std::get<1>(result);
   done = std::get<2>(result);
 
+  // Bound the reward between -1 and 1.
+  reward = std::max(-1.0f, std::min(reward, 1.0f));
+  rewards.push_back(reward);
+
   // Move the state tensor to the GPU if the gpu ID is set.
   if (args.gpu_id >= 0)
   {
@@ -67,22 +187,77 @@ void Agent::action_test()
   ++eps_len;
 }
 
-void Agent::action_train()
+void Agent::clear_actions()
 {
-  auto st = state.unsqueeze(0);
+  values.clear();
+  log_probs.clear();
+  entropies.clear();
+  rewards.clear();
+}
 
-  // If the gpu ID is set, move the hx and cx tensors to the gpu.
+void Agent::reset_episode()
+{
+  state = env.reset();
+  done = true;
+  eps_len = 0;
+  eps_reward = 0;
+
+  hx = torch::zeros({1, 512});
+  cx = torch::zeros({1, 512});
+}
+
+std::vector<char> Agent::save_state()
+{
+  return pack_state({&env}, &eps_len, &eps_reward, hx, cx, done);
+}
+
+void Agent::load_state(const char* data, size_t size)
+{
+  if (!hx.defined())
+  {
+    hx = torch::zeros({1, 512});
+    cx = torch::zeros({1, 512});
+  }
+
+  done = unpack_state(data, size, {&env}, &eps_len, &eps_reward, hx, cx);
+  state = env.get_state();
+}
+
+VecAgent::VecAgent(LSTMModel& model, VecAtariEnv& envs, Args args)
+  : model(model), envs(envs), args(args),
+    eps_reward(envs.size(), 0.0f), eps_len(envs.size(), 0) {
+  state = envs.reset();
+  reset_hidden();
+}
+
+void VecAgent::reset_hidden()
+{
+  clear_cache();
+
+  hx = torch::zeros({envs.size(), 512}, torch::kFloat32);
+  cx = torch::zeros({envs.size(), 512}, torch::kFloat32);
+
+  // If the gpu ID is set, keep the hidden states on the gpu.
   if (args.gpu_id >= 0)
   {
     hx = hx.to(torch::kCUDA);
     cx = cx.to(torch::kCUDA);
+  }
+}
+
+void VecAgent::action_train()
+{
+  auto st = state;
+
+  // If the gpu ID is set, move the batched state to the gpu.
+  if (args.gpu_id >= 0)
+  {
     st = st.to(torch::kCUDA);
   }
 
-  // Get the value, logit, and (hx, cx) tensors from the model.
-  auto output = model.forward(torch::TensorList({st, hx, cx})).toTensorList();
+  // Run one forward over the whole batch of environments.
+  auto output = model.forward(torch::TensorList({LSTMModel::input(st), hx, cx})).toTensorList();
 
-  // Get the value, logit, and new (hx, cx) tensors from the output.
   auto value = output.get(0);
   auto logit = output.get(1);
   hx = output.get(2);
@@ -94,47 +269,184 @@ void Agent::action_train()
   auto prob = torch::softmax(logit, 1);
   auto log_prob = torch::log_softmax(logit, 1);
 
-  // Get the entropy from the prob and log_prob tensors.
+  // Get the per-environment entropy from the prob and log_prob tensors.
   auto entropy = -(prob * log_prob).sum(1);
   entropies.push_back(entropy);
 
+  // Sample one action per environment.
   auto action = prob.multinomial(1).data();
 
-  //std::cout << "action " << action.item<int>() << " value " << value.item<float>() << " reward " << reward << " entropy " << entropy.item<float>() << "\n";
+  log_probs.push_back(log_prob.gather(1, action));
 
-  //std::cerr << "policy " << prob << " action " << action <<  " entropy " << entropy << std::endl;
-  //std::cerr << "policy " << prob.toString() << std::endl;
+  torch::Tensor reward, mask;
+  step_envs(action, reward, mask);
 
-  log_prob = log_prob.gather(1, action);
-  log_probs.push_back(log_prob);
-  
-  // Sample an action from the probability distribution.
-  // Step the environment
-  auto result = env.step(action.item().toInt());
+  // Rewards and masks stay on the host, where returns are computed.
+  rewards.push_back(reward);
+  masks.push_back(mask);
+}
+
+void VecAgent::action_rollout(RolloutBuffer& rollout)
+{
+  torch::InferenceMode guard;
+
+  auto st = state;
+
+  // If the gpu ID is set, move the batched state to the gpu.
+  if (args.gpu_id >= 0)
+  {
+    st = st.to(torch::kCUDA);
+  }
+
+  torch::Tensor logit;
+
+  if (cached_logit.defined())
+  {
+    // The bootstrap forward of the last rollout already ran on this state.
+    logit = cached_logit;
+    hx = cached_hx;
+    cx = cached_cx;
+    clear_cache();
+  } else {
+    auto output = model.forward(torch::TensorList({LSTMModel::input(st), hx, cx})).toTensorList();
+
+    logit = output.get(1);
+    hx = output.get(2);
+    cx = output.get(3);
+  }
+
+  // Record the observation the action is taken in, for the learner to
+  // recompute the model on. On the CPU, st is the environments' own buffer,
+  // which stepping overwrites with the next observation.
+  rollout.push_frames(st);
+
+  // Sample one action per environment.
+  auto action = torch::softmax(logit, 1).multinomial(1).squeeze(1);
+
+  torch::Tensor reward, mask;
+  step_envs(action, reward, mask);
+
+  rollout.push_step(action, reward, mask);
+}
+
+torch::Tensor VecAgent::bootstrap()
+{
+  torch::InferenceMode guard;
+
+  auto st = state;
+
+  // If the gpu ID is set, move the batched state to the gpu.
+  if (args.gpu_id >= 0)
+  {
+    st = st.to(torch::kCUDA);
+  }
+
+  auto output = model.forward(torch::TensorList({LSTMModel::input(st), hx, cx})).toTensorList();
+
+  // The next step acts from this same forward.
+  cached_logit = output.get(1);
+  cached_hx = output.get(2);
+  cached_cx = output.get(3);
+
+  return output.get(0).squeeze(1);
+}
+
+void VecAgent::clear_cache()
+{
+  cached_logit = torch::Tensor();
+  cached_hx = torch::Tensor();
+  cached_cx = torch::Tensor();
+}
+
+void VecAgent::step_envs(const torch::Tensor& action, torch::Tensor& reward, torch::Tensor& mask)
+{
+  auto action_cpu = action.to(torch::kCPU).view({-1});
+  auto action_a = action_cpu.accessor<int64_t, 1>();
+
+  std::vector<int> actions(envs.size());
+  for (int i = 0; i < envs.size(); i++)
+    actions[i] = action_a[i];
+
+  // Step every environment.
+  auto result = envs.step(actions);
 
-  // Get the new state, reward, and done tensors from the result.
   state = std::get<0>(result);
   reward = std::get<1>(result);
-  done = std::get<2>(result);
+  auto done = std::get<2>(result);
 
-  // Bound the reward between -1 and 1.
-  reward = std::max(-1.0f, std::min(reward, 1.0f));
-  rewards.push_back(reward);
+  // Track episode statistics per environment.
+  auto reward_a = reward.accessor<float, 1>();
+  auto done_a = done.accessor<bool, 1>();
 
-  // Move the state tensor to the GPU if the gpu ID is set.
+  for (int i = 0; i < envs.size(); i++)
+  {
+    eps_reward[i] += reward_a[i];
+    ++eps_len[i];
+  }
+
+  // Bound the rewards between -1 and 1.
+  reward = reward.clamp(-1.0f, 1.0f);
+
+  // Environments which just terminated were reset by the vector env; their
+  // hidden states restart from zero and the return must not bootstrap past
+  // the terminal step.
+  mask = 1.0f - done.to(torch::kFloat32);
+
+  auto hidden_mask = mask.unsqueeze(1);
   if (args.gpu_id >= 0)
+    hidden_mask = hidden_mask.to(torch::kCUDA);
+
+  hx = hx * hidden_mask;
+  cx = cx * hidden_mask;
+
+  // Record finished episodes.
+  for (int i = 0; i < envs.size(); i++)
   {
-    state = state.to(torch::kCUDA);
+    if (done_a[i])
+    {
+      log_debug("env %d terminated episode len %d rw %f", i, eps_len[i], eps_reward[i]);
+      eps_reward[i] = 0;
+      eps_len[i] = 0;
+    }
   }
+}
 
-  // Increment the episode length
-  ++eps_len;
+void VecAgent::reset_episode()
+{
+  state = envs.reset();
+  reset_hidden();
+
+  std::fill(eps_reward.begin(), eps_reward.end(), 0.0f);
+  std::fill(eps_len.begin(), eps_len.end(), 0);
 }
 
-void Agent::clear_actions()
+std::vector<char> VecAgent::save_state()
+{
+  std::vector<AtariEnv*> list;
+  for (int i = 0; i < envs.size(); i++)
+    list.push_back(&envs.get(i));
+
+  return pack_state(list, eps_len.data(), eps_reward.data(), hx, cx, false);
+}
+
+void VecAgent::load_state(const char* data, size_t size)
+{
+  std::vector<AtariEnv*> list;
+  for (int i = 0; i < envs.size(); i++)
+    list.push_back(&envs.get(i));
+
+  // A kept bootstrap forward belongs to the replaced states
+  clear_cache();
+
+  unpack_state(data, size, list, eps_len.data(), eps_reward.data(), hx, cx);
+  state = envs.sync();
+}
+
+void VecAgent::clear_actions()
 {
   values.clear();
   log_probs.clear();
   entropies.clear();
   rewards.clear();
+  masks.clear();
 }
@@ -13,7 +13,32 @@
 
 #include "model.h"
 #include "env.h"
+#include "vecenv.h"
 #include "args.h"
+#include "rollout.h"
+
+// Agent state wire format identification ("AFDA").
+static const uint32_t AGENT_WIRE_MAGIC = 0x41444641;
+
+/**
+ * Header of a serialized agent state. Each environment follows as an
+ * AgentEnvRecord and its serialized AtariEnv state, then the hidden states
+ * hx and cx as float32 [envs, hidden].
+ */
+struct AgentStateHeader
+{
+  uint32_t magic;  // AGENT_WIRE_MAGIC
+  uint32_t envs;   // number of environments
+  uint32_t hidden; // LSTM state width
+  uint32_t done;   // single agent: the last step ended an episode
+};
+
+struct AgentEnvRecord
+{
+  int32_t eps_len;    // steps of the running episode
+  float eps_reward;   // reward of the running episode
+  uint64_t bytes;     // serialized environment size
+};
 
 class Agent {
   public:
@@ -31,14 +56,30 @@ class Agent {
     void action_train();
 
     /**
-     * @brief Perform a testing step.
+     * Clear the action history.
      */
-    void action_test();
+    void clear_actions();
 
     /**
-     * Clear the action history.
+     * @brief Start a new episode from a zero hidden state.
      */
-    void clear_actions();
+    void reset_episode();
+
+    /**
+     * @brief Serialize the running episode: environment, hidden state and
+     * episode statistics.
+     *
+     * @return std::vector<char> The agent state.
+     */
+    std::vector<char> save_state();
+
+    /**
+     * @brief Continue an episode serialized by save_state().
+     *
+     * @param data The agent state.
+     * @param size The size of the agent state in bytes.
+     */
+    void load_state(const char* data, size_t size);
 
   private:
     // Arguments
@@ -65,9 +106,10 @@ class Agent {
     std::vector<float> rewards;
     float reward = 0;
 
-    // Episode length
+    // Episode length and reward
     int eps_len = 0;
-    
+    float eps_reward = 0;
+
     // Values
     std::vector<torch::Tensor> values;
 
@@ -77,3 +119,126 @@ class Agent {
     // Terminal state
     bool done = true;
 };
+
+/**
+ * Agent driving a vector of environments with a single batched model forward
+ * per step.
+ */
+class VecAgent {
+  public:
+    /**
+     * @brief VecAgent constructor.
+     *
+     * @param model The model to be used.
+     * @param envs The environments to be used.
+     */
+    VecAgent(LSTMModel& model, VecAtariEnv& envs, Args args);
+
+    /**
+     * @brief Perform a batched training step over every environment.
+     */
+    void action_train();
+
+    /**
+     * @brief Perform a batched step without autograd, recording it into a
+     * rollout buffer for the learner to recompute.
+     *
+     * @param rollout The rollout being filled.
+     */
+    void action_rollout(RolloutBuffer& rollout);
+
+    /**
+     * @brief Evaluate the current states without autograd. The forward is
+     * kept, and the next action_rollout() acts from it instead of running
+     * the model again.
+     *
+     * The optimizer step that follows a bootstrap changes the parameters,
+     * so that first action is sampled one update behind: one step of each
+     * rollout is slightly off-policy, in exchange for one batch-N forward
+     * less per rollout. The loss is unaffected, since the learner
+     * recomputes every logit with the current parameters, and A3C workers
+     * act on parameters that lag the global model much further anyway.
+     *
+     * @return torch::Tensor The values of the current states [N].
+     */
+    torch::Tensor bootstrap();
+
+    /**
+     * @brief Reset the hidden states of every environment.
+     */
+    void reset_hidden();
+
+    /**
+     * Clear the action history.
+     */
+    void clear_actions();
+
+    /**
+     * @brief Start a new episode in every environment from a zero hidden
+     * state.
+     */
+    void reset_episode();
+
+    /**
+     * @brief Serialize the running episodes: environments, hidden states and
+     * episode statistics.
+     *
+     * @return std::vector<char> The agent state.
+     */
+    std::vector<char> save_state();
+
+    /**
+     * @brief Continue episodes serialized by save_state().
+     *
+     * @param data The agent state.
+     * @param size The size of the agent state in bytes.
+     */
+    void load_state(const char* data, size_t size);
+
+  private:
+    /**
+     * Steps every environment, tracks episode statistics and masks the
+     * hidden states of terminated environments.
+     *
+     * @param action Actions to take [N] or [N, 1].
+     * @param reward Output clipped rewards [N] (CPU).
+     * @param mask Output continuation masks [N] (CPU).
+     */
+    void step_envs(const torch::Tensor& action, torch::Tensor& reward, torch::Tensor& mask);
+
+    /**
+     * Drops the kept bootstrap forward.
+     */
+    void clear_cache();
+
+    // Arguments
+    Args args;
+
+    // Policy logits and hidden states of the last bootstrap forward
+    torch::Tensor cached_logit, cached_hx, cached_cx;
+
+  public:
+
+    // LSTM hx, cx state, [N, 512]
+    torch::Tensor hx, cx;
+
+    // Environments
+    VecAtariEnv& envs;
+
+    // Model
+    LSTMModel& model;
+
+    // Current observations, [N, C, OBS_PACKED]
+    torch::Tensor state;
+
+    // Per-step log probabilities [N, 1], values [N, 1] and entropies [N]
+    std::vector<torch::Tensor> log_probs, values, entropies;
+
+    // Per-step clipped rewards [N] and continuation masks [N] (0 after a
+    // terminal), kept on the CPU
+    std::vector<torch::Tensor> rewards, masks;
+
+    // Per-environment episode reward and length
+    std::vector<float> eps_reward;
+    std::vector<int> eps_len;
+};
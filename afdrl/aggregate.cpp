@@ -0,0 +1,215 @@
+/**
+ * @file aggregate.cpp
+ * @brief Strategies for merging client updates into the global model
+ */
+
+#include "aggregate.h"
+#include "codec.h"
+#include "log.h"
+
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+Aggregator::Aggregator(LSTMModel& model)
+  : model(model)
+{
+  vector<int64_t> segments = model.segment_sizes();
+  buffer = torch::zeros({std::accumulate(segments.begin(), segments.end(), (int64_t) 0)});
+}
+
+bool Aggregator::merge_sum(const char* data, size_t size, double total_weight)
+{
+  throw runtime_error("aggregator cannot merge pre-reduced updates");
+}
+
+void Aggregator::apply(const char* data, size_t size, float weight)
+{
+  if (model.is_flat())
+  {
+    // Decode (or scatter, for sparse updates) straight into the global model
+    apply_update(data, size, model.flat_params, weight, model.schema_hash());
+    return;
+  }
+
+  buffer.zero_();
+  apply_update(data, size, buffer, weight, model.schema_hash());
+  model.add_flat(buffer, 1.0f);
+}
+
+void Aggregator::accumulate(const char* data, size_t size, float weight)
+{
+  apply_update(data, size, buffer, weight, model.schema_hash());
+}
+
+void Aggregator::commit(float scale)
+{
+  model.add_flat(buffer, scale);
+  buffer.zero_();
+}
+
+/**
+ * Adds every update to the global model as it arrives.
+ */
+class SumAggregator : public Aggregator
+{
+public:
+    SumAggregator(LSTMModel& model)
+      : Aggregator(model)
+    {
+    }
+
+    bool merge(const char* data, size_t size, const MergeInfo& info) override
+    {
+      apply(data, size, 1.0f);
+      return true;
+    }
+
+    bool is_linear() const override { return true; }
+
+    bool merge_sum(const char* data, size_t size, double total_weight) override
+    {
+      apply(data, size, 1.0f);
+      return true;
+    }
+};
+
+/**
+ * FedAvg: the updates merging at a federation time are averaged, weighted
+ * by their step counts, and applied together when the time step ends.
+ */
+class FedAvgAggregator : public Aggregator
+{
+public:
+    FedAvgAggregator(LSTMModel& model, float server_lr)
+      : Aggregator(model), server_lr(server_lr)
+    {
+    }
+
+    bool merge(const char* data, size_t size, const MergeInfo& info) override
+    {
+      float w = weight(info);
+
+      accumulate(data, size, w);
+      total_weight += w;
+
+      return false;
+    }
+
+    bool is_linear() const override { return true; }
+
+    float weight(const MergeInfo& info) const override
+    {
+      return max(info.steps, 1);
+    }
+
+    bool merge_sum(const char* data, size_t size, double weight) override
+    {
+      accumulate(data, size, 1.0f);
+      total_weight += weight;
+
+      return false;
+    }
+
+    bool end_time(int F_time) override
+    {
+      if (total_weight == 0)
+        return false;
+
+      commit(server_lr / total_weight);
+      total_weight = 0;
+
+      return true;
+    }
+
+private:
+    float server_lr;
+    double total_weight = 0;
+};
+
+/**
+ * FedAsync: every update is applied on arrival, discounted by its staleness
+ * with the polynomial weight alpha * (1 + staleness)^-exponent.
+ */
+class FedAsyncAggregator : public Aggregator
+{
+public:
+    FedAsyncAggregator(LSTMModel& model, float alpha, float exponent, bool staleness_by_time)
+      : Aggregator(model), alpha(alpha), exponent(exponent), staleness_by_time(staleness_by_time)
+    {
+    }
+
+    bool merge(const char* data, size_t size, const MergeInfo& info) override
+    {
+      // Staleness is the number of global updates the job missed, or the
+      // federation time it spent offline.
+      int staleness = staleness_by_time
+        ? info.end_time - info.start_time
+        : info.version - info.start_version;
+
+      float weight = alpha * pow(1.0f + max(staleness, 0), -exponent);
+
+      log_debug("FedAsync merge client %d staleness %d weight %f", info.client, staleness, weight);
+
+      apply(data, size, weight);
+      return true;
+    }
+
+private:
+    float alpha, exponent;
+    bool staleness_by_time;
+};
+
+/**
+ * FedBuff: updates are buffered and their mean is applied once K of them
+ * have arrived.
+ */
+class FedBuffAggregator : public Aggregator
+{
+public:
+    FedBuffAggregator(LSTMModel& model, int buffer_size, float server_lr)
+      : Aggregator(model), buffer_size(buffer_size), server_lr(server_lr)
+    {
+      if (buffer_size < 1)
+        throw runtime_error("FedBuff buffer size must be positive");
+    }
+
+    bool merge(const char* data, size_t size, const MergeInfo& info) override
+    {
+      accumulate(data, size, 1.0f);
+
+      if (++buffered < buffer_size)
+        return false;
+
+      commit(server_lr / buffered);
+      buffered = 0;
+
+      return true;
+    }
+
+private:
+    int buffer_size;
+    float server_lr;
+    int buffered = 0;
+};
+
+std::unique_ptr<Aggregator> make_aggregator(const Args& args, LSTMModel& model)
+{
+  if (args.aggregator == "sum")
+    return std::unique_ptr<Aggregator>(new SumAggregator(model));
+  if (args.aggregator == "fedavg")
+    return std::unique_ptr<Aggregator>(new FedAvgAggregator(model, args.server_lr));
+  if (args.aggregator == "fedasync")
+  {
+    if (args.staleness != "version" && args.staleness != "time")
+      throw runtime_error("unknown staleness measure: " + args.staleness);
+
+    return std::unique_ptr<Aggregator>(new FedAsyncAggregator(model, args.async_alpha, args.staleness_exp, args.staleness == "time"));
+  }
+  if (args.aggregator == "fedbuff")
+    return std::unique_ptr<Aggregator>(new FedBuffAggregator(model, args.buffer_size, args.server_lr));
+
+  throw runtime_error("unknown aggregator: " + args.aggregator);
+}
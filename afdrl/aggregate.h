@@ -0,0 +1,119 @@
+/**
+ * @file aggregate.h
+ * @brief Strategies for merging client updates into the global model
+ */
+
+#ifndef AFDRL_AGGREGATE_H
+#define AFDRL_AGGREGATE_H
+
+#include "torch_pch.h"
+#include "args.h"
+#include "model.h"
+
+#include <memory>
+
+/**
+ * What the scheduler knows about a client update being merged.
+ */
+struct MergeInfo
+{
+  int client;        // client (schedule) index
+  int steps;         // environment steps the client trained for
+  int start_time;    // federation time the job started
+  int end_time;      // federation time the job joins
+  int start_version; // global model version the job trained from
+  int version;       // current global model version
+};
+
+/**
+ * Merges encoded client updates (see codec.h) into the global model. Updates
+ * are decoded straight into flat float buffers with their weight applied, so
+ * each merge is a single pass over the update.
+ */
+class Aggregator
+{
+public:
+    /**
+     * Constructs an aggregator.
+     *
+     * @param model The global model.
+     */
+    Aggregator(LSTMModel& model);
+
+    virtual ~Aggregator() {}
+
+    /**
+     * Merges a client update.
+     *
+     * @param data The encoded update.
+     * @param size The encoded update size in bytes.
+     * @param info The update's merge information.
+     * @return Whether the global model changed.
+     */
+    virtual bool merge(const char* data, size_t size, const MergeInfo& info) = 0;
+
+    /**
+     * Ends a federation time step, after every merge at that time.
+     *
+     * @param F_time The federation time ending.
+     * @return Whether the global model changed.
+     */
+    virtual bool end_time(int F_time) { return false; }
+
+    /**
+     * Whether merging the weighted sum of updates with merge_sum() is the
+     * same as merging them one by one at the same federation time.
+     */
+    virtual bool is_linear() const { return false; }
+
+    /**
+     * Get the weight of an update in a linear merge rule.
+     *
+     * @param info The update's merge information.
+     * @return The weight.
+     */
+    virtual float weight(const MergeInfo& info) const { return 1.0f; }
+
+    /**
+     * Merges a pre-reduced update: the sum of several updates, each scaled
+     * by its weight(). Only for linear merge rules.
+     *
+     * @param data The encoded sum.
+     * @param size The encoded sum size in bytes.
+     * @param total_weight The sum of the weights.
+     * @return Whether the global model changed.
+     */
+    virtual bool merge_sum(const char* data, size_t size, double total_weight);
+
+protected:
+    /**
+     * Adds a weighted update to the global model.
+     */
+    void apply(const char* data, size_t size, float weight);
+
+    /**
+     * Adds a weighted update to the accumulation buffer.
+     */
+    void accumulate(const char* data, size_t size, float weight);
+
+    /**
+     * Adds the scaled accumulation buffer to the global model and clears it.
+     */
+    void commit(float scale);
+
+    LSTMModel& model;
+
+    // Flat update accumulator (or decode scratch for unflattened models)
+    torch::Tensor buffer;
+};
+
+/**
+ * Makes the aggregator selected by the arguments.
+ *
+ * @param args The configuration arguments.
+ * @param model The global model.
+ * @return The aggregator.
+ */
+std::unique_ptr<Aggregator> make_aggregator(const Args& args, LSTMModel& model);
+
+#endif
@@ -27,7 +27,11 @@ struct Args {
       } else if (arg == "--roms") {
         roms = argv[++i];
       } else if (arg == "-t" || arg == "--test") {
-        test_steps = std::stoi(argv[++i]);
+        test_episodes = std::stoi(argv[++i]);
+      } else if (arg == "--test-threads") {
+        test_threads = std::stoi(argv[++i]);
+      } else if (arg == "--test-ranks") {
+        test_ranks = std::stoi(argv[++i]);
       } else if (arg == "-f" || arg == "--frame-skip") {
         frame_skip = std::stoi(argv[++i]);
       } else if (arg == "-m" || arg == "--max-episode-length") {
@@ -58,6 +62,58 @@ struct Args {
         num_steps = std::stoi(argv[++i]);
       } else if (arg == "--a3c-steps") {
         a3c_steps = std::stoi(argv[++i]);
+      } else if (arg == "--preprocess") {
+        preprocess = argv[++i];
+      } else if (arg == "--max-pool") {
+        max_pool = true;
+      } else if (arg == "--no-flat-params") {
+        flat_params = false;
+      } else if (arg == "--codec") {
+        codec = argv[++i];
+      } else if (arg == "--topk-ratio") {
+        topk_ratio = std::stof(argv[++i]);
+      } else if (arg == "--no-error-feedback") {
+        error_feedback = false;
+      } else if (arg == "--param-stats-every") {
+        param_stats_every = std::stoi(argv[++i]);
+      } else if (arg == "--aggregator") {
+        aggregator = argv[++i];
+      } else if (arg == "--server-lr") {
+        server_lr = std::stof(argv[++i]);
+      } else if (arg == "--async-alpha") {
+        async_alpha = std::stof(argv[++i]);
+      } else if (arg == "--staleness-exp") {
+        staleness_exp = std::stof(argv[++i]);
+      } else if (arg == "--staleness") {
+        staleness = argv[++i];
+      } else if (arg == "--buffer-size") {
+        buffer_size = std::stoi(argv[++i]);
+      } else if (arg == "--optim-state") {
+        optim_state = argv[++i];
+      } else if (arg == "--env-state") {
+        env_state = argv[++i];
+      } else if (arg == "--model-transport") {
+        model_transport = argv[++i];
+      } else if (arg == "--sub-aggregators") {
+        sub_aggregators = true;
+      } else if (arg == "--reset-pool") {
+        reset_pool = std::stoi(argv[++i]);
+      } else if (arg == "--reset-noops") {
+        reset_noops = std::stoi(argv[++i]);
+      } else if (arg == "--reset-pool-file") {
+        reset_pool_file = argv[++i];
+      } else if (arg == "--update-memory") {
+        update_memory = std::stoi(argv[++i]);
+      } else if (arg == "--update-spill") {
+        update_spill = argv[++i];
+      } else if (arg == "--num-envs") {
+        num_envs = std::stoi(argv[++i]);
+      } else if (arg == "--rollout") {
+        rollout = argv[++i];
+      } else if (arg == "--worker-threads") {
+        worker_threads = std::stoi(argv[++i]);
+      } else if (arg == "--intra-op-threads") {
+        intra_op_threads = std::stoi(argv[++i]);
       } else if (arg == "--debug") {
         debug = 1;
       } else if (arg == "--optimizer")
@@ -88,7 +144,7 @@ struct Args {
     std::cout << "\t\tLog file." << std::endl;
 
     std::cout << "\t-r, --results-file" << std::endl;
-    std::cout << "\t\tResults file." << std::endl;
+    std::cout << "\t\tResults file (scheduler metrics CSV)." << std::endl;
 
     std::cout << "\t-g, --gpu" << std::endl;
     std::cout << "\t\tGPU ID (-1 = CPU)." << std::endl;
@@ -97,7 +153,13 @@ struct Args {
     std::cout << "\t\tEnvironment name." << std::endl;
 
     std::cout << "\t-t, --test" << std::endl;
-    std::cout << "\t\tNumber of test steps." << std::endl;
+    std::cout << "\t\tTest episodes played per evaluated model version." << std::endl;
+
+    std::cout << "\t--test-threads" << std::endl;
+    std::cout << "\t\tThreads stepping the test environments of each tester." << std::endl;
+
+    std::cout << "\t--test-ranks" << std::endl;
+    std::cout << "\t\tRanks after the scheduler which evaluate, sharing the model versions." << std::endl;
 
     std::cout << "\t-f, --frame-skip" << std::endl;
     std::cout << "\t\tNumber of frames to skip between actions." << std::endl;
@@ -132,6 +194,84 @@ struct Args {
     std::cout << "\t--a3c-steps" << std::endl;
     std::cout << "\t\tA3C forward steps per model update" << std::endl;
 
+    std::cout << "\t--preprocess" << std::endl;
+    std::cout << "\t\tObservation preprocessing backend. (fused, opencv, palette)" << std::endl;
+
+    std::cout << "\t--max-pool" << std::endl;
+    std::cout << "\t\tObserve the per-channel max of each screen and the previous one." << std::endl;
+
+    std::cout << "\t--no-flat-params" << std::endl;
+    std::cout << "\t\tKeep model parameters in separate tensors instead of one flat buffer." << std::endl;
+
+    std::cout << "\t--codec" << std::endl;
+    std::cout << "\t\tModel update encoding. (fp32, fp16, int8, topk)" << std::endl;
+
+    std::cout << "\t--topk-ratio" << std::endl;
+    std::cout << "\t\tFraction of update elements kept by the topk codec." << std::endl;
+
+    std::cout << "\t--no-error-feedback" << std::endl;
+    std::cout << "\t\tDrop compression error instead of carrying it into the next update." << std::endl;
+
+    std::cout << "\t--param-stats-every" << std::endl;
+    std::cout << "\t\tMerges between per-parameter statistics in the results file (0 = never)." << std::endl;
+
+    std::cout << "\t--aggregator" << std::endl;
+    std::cout << "\t\tClient update merge strategy. (sum, fedavg, fedasync, fedbuff)" << std::endl;
+
+    std::cout << "\t--server-lr" << std::endl;
+    std::cout << "\t\tScale of the averaged update applied by fedavg and fedbuff." << std::endl;
+
+    std::cout << "\t--async-alpha" << std::endl;
+    std::cout << "\t\tfedasync mixing weight of a fresh update." << std::endl;
+
+    std::cout << "\t--staleness-exp" << std::endl;
+    std::cout << "\t\tfedasync staleness discount exponent." << std::endl;
+
+    std::cout << "\t--staleness" << std::endl;
+    std::cout << "\t\tfedasync staleness measure. (version, time)" << std::endl;
+
+    std::cout << "\t--buffer-size" << std::endl;
+    std::cout << "\t\tUpdates fedbuff collects before applying them." << std::endl;
+
+    std::cout << "\t--optim-state" << std::endl;
+    std::cout << "\t\tOptimizer state between jobs. (reset, worker, client)" << std::endl;
+
+    std::cout << "\t--env-state" << std::endl;
+    std::cout << "\t\tEpisode state between jobs. worker: the worker's environments carry on; client: each client's episode and hidden state travel with its jobs." << std::endl;
+
+    std::cout << "\t--model-transport" << std::endl;
+    std::cout << "\t\tGlobal model delivery. p2p: a copy per rank from the scheduler; shared: one copy per node in an MPI shared memory window." << std::endl;
+
+    std::cout << "\t--sub-aggregators" << std::endl;
+    std::cout << "\t\tDedicate one training rank per remote node to summing its node's updates before they reach the scheduler (sum, fedavg)." << std::endl;
+
+    std::cout << "\t--reset-pool" << std::endl;
+    std::cout << "\t\tPre-generated episode start states training environments reset to (0 = reset the game)." << std::endl;
+
+    std::cout << "\t--reset-noops" << std::endl;
+    std::cout << "\t\tMost random no-ops taken to reach a reset pool state." << std::endl;
+
+    std::cout << "\t--reset-pool-file" << std::endl;
+    std::cout << "\t\tFile the reset pool is shared through by the ranks of a node." << std::endl;
+
+    std::cout << "\t--update-memory" << std::endl;
+    std::cout << "\t\tMegabytes of early client updates and optimizer states the scheduler keeps in memory (0 = no limit)." << std::endl;
+
+    std::cout << "\t--update-spill" << std::endl;
+    std::cout << "\t\tFile holding early client updates and optimizer states past the memory limit." << std::endl;
+
+    std::cout << "\t--num-envs" << std::endl;
+    std::cout << "\t\tEnvironments stepped together by each training rank." << std::endl;
+
+    std::cout << "\t--rollout" << std::endl;
+    std::cout << "\t\tRollout mode. step: learn from the acting forwards; sequence: act without autograd and recompute the rollout in one batched pass." << std::endl;
+
+    std::cout << "\t--worker-threads" << std::endl;
+    std::cout << "\t\tClient jobs each training rank runs at once, one per thread." << std::endl;
+
+    std::cout << "\t--intra-op-threads" << std::endl;
+    std::cout << "\t\tlibtorch intra-op threads of each training rank (0 = cores / worker threads, or the libtorch default with one worker)." << std::endl;
+
     std::cout << "\t--debug" << std::endl;
     std::cout << "\t\tEnable debug mode." << std::endl;
 
@@ -167,7 +307,9 @@ struct Args {
   int gpu_id = -1; // -1 = CPU, 0 = first GPU, 1 = second GPU, etc.
   std::string env_name = "pong"; // Environment name
 
-  int test_steps = 100; // Number of test steps
+  int test_episodes = 8; // Test episodes per evaluated model version
+  int test_threads = 4; // Environment stepping threads per tester
+  int test_ranks = 1; // Tester ranks (1 .. test_ranks)
   int frame_skip = 4; // Number of frames to skip between actions
   int frame_stack = 1; // Number of frames to stack in model input
   int max_episode_length = 10000; // 0 = no limit
@@ -182,6 +324,32 @@ struct Args {
   int num_clients = 4; // Number of simulated clients
   int num_steps = 10000; // Total federation time steps
   int a3c_steps = 20; // A3C forward steps per model update
+  std::string preprocess = "fused"; // Observation preprocessing (fused, opencv, palette)
+  bool max_pool = false; // Max-pool the last two screens of each observation
+  bool flat_params = true; // Back model parameters with one contiguous buffer
+  std::string codec = "fp32"; // Model update encoding (fp32, fp16, int8, topk)
+  float topk_ratio = 0.01; // Fraction of elements kept by the topk codec
+  bool error_feedback = true; // Keep per-client compression residuals
+  int param_stats_every = 100; // Merges between per-parameter results records (0 = never)
+  std::string aggregator = "sum"; // Client update merge strategy (sum, fedavg, fedasync, fedbuff)
+  float server_lr = 1.0; // Scale of fedavg/fedbuff averaged updates
+  float async_alpha = 0.6; // fedasync weight of a fresh update
+  float staleness_exp = 0.5; // fedasync staleness discount exponent
+  std::string staleness = "version"; // fedasync staleness measure (version, time)
+  int buffer_size = 10; // fedbuff updates per global update
+  std::string optim_state = "reset"; // Optimizer state between jobs (reset, worker, client)
+  std::string env_state = "worker"; // Episode state between jobs (worker, client)
+  std::string model_transport = "p2p"; // Global model delivery (p2p, shared)
+  bool sub_aggregators = false; // Pre-reduce updates on one rank per node
+  int reset_pool = 0; // Pre-generated start states (0 = none)
+  int reset_noops = 30; // Most no-ops before a start state
+  std::string reset_pool_file = ""; // Node-shared reset pool file (empty = per process)
+  int update_memory = 0; // Early update memory budget in MB (0 = no limit)
+  std::string update_spill = ""; // Spill file for early updates (empty = none)
+  int num_envs = 1; // Environments per training rank (batched forward when > 1)
+  std::string rollout = "step"; // Rollout mode (step, sequence)
+  int worker_threads = 1; // Concurrent client jobs per training rank
+  int intra_op_threads = 0; // libtorch intra-op threads per training rank (0 = auto)
   int debug = 0; // Debug mode
 
   float lr = 0.0001; // Learning rate
@@ -0,0 +1,317 @@
+/**
+ * @file codec.cpp
+ * @brief Compressed model update codecs
+ */
+
+#include "codec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * Wraps raw update memory in a flat tensor without copying.
+ */
+static torch::Tensor blob(const char* data, int64_t n, torch::ScalarType type)
+{
+  return torch::from_blob(const_cast<char*>(data), {n}, torch::TensorOptions().dtype(type));
+}
+
+UpdateCodec parse_codec(const std::string& name)
+{
+  if (name == "fp32")
+    return CODEC_FP32;
+  if (name == "fp16")
+    return CODEC_FP16;
+  if (name == "int8")
+    return CODEC_INT8;
+  if (name == "topk")
+    return CODEC_TOPK;
+
+  throw runtime_error("unknown update codec: " + name);
+}
+
+UpdateEncoder::UpdateEncoder(UpdateCodec codec, float topk_ratio, bool error_feedback)
+  : codec(codec), topk_ratio(topk_ratio), error_feedback(error_feedback && codec != CODEC_FP32)
+{
+  if (codec == CODEC_TOPK && (topk_ratio <= 0.0f || topk_ratio > 1.0f))
+    throw runtime_error("top-k ratio must be in (0, 1]");
+}
+
+std::vector<char> UpdateEncoder::encode(const torch::Tensor& delta, const std::vector<int64_t>& segments, uint64_t schema,
+    std::vector<char>* residual) const
+{
+  torch::NoGradGuard no_grad;
+
+  torch::Tensor x = delta.detach().contiguous().view({-1});
+  int64_t numel = x.numel();
+
+  if (x.scalar_type() != torch::kFloat || !x.device().is_cpu())
+    throw runtime_error("updates must be encoded from a CPU float tensor");
+
+  bool feedback = error_feedback && residual;
+
+  if (residual && !feedback)
+    residual->clear();
+
+  // Carry over what previous lossy encodings of this client dropped.
+  if (feedback && !residual->empty())
+  {
+    if (residual->size() != numel * sizeof(float))
+      throw runtime_error("residual size mismatch");
+
+    x = x + blob(residual->data(), numel, torch::kFloat);
+  }
+
+  UpdateHeader header;
+  header.magic = UPDATE_WIRE_MAGIC;
+  header.codec = codec;
+  header.schema = schema;
+  header.numel = numel;
+  header.count = numel;
+  header.segments = 0;
+
+  std::vector<char> buffer;
+
+  // Dense reconstruction of what the scheduler will apply.
+  torch::Tensor decoded;
+
+  switch (codec)
+  {
+    case CODEC_FP32:
+      {
+        buffer.resize(sizeof(header) + numel * sizeof(float));
+        memcpy(buffer.data() + sizeof(header), x.data_ptr<float>(), numel * sizeof(float));
+      }
+      break;
+    case CODEC_FP16:
+      {
+        buffer.resize(sizeof(header) + numel * 2);
+        blob(buffer.data() + sizeof(header), numel, torch::kHalf).copy_(x);
+
+        if (feedback)
+          decoded = blob(buffer.data() + sizeof(header), numel, torch::kHalf).to(torch::kFloat);
+      }
+      break;
+    case CODEC_INT8:
+      {
+        int64_t total = 0;
+        for (int64_t n : segments)
+          total += n;
+
+        if (total != numel)
+          throw runtime_error("update segments do not cover the delta");
+
+        header.segments = segments.size();
+        buffer.resize(sizeof(header) + segments.size() * (sizeof(int64_t) + sizeof(float)) + numel);
+
+        int64_t* lengths = reinterpret_cast<int64_t*>(buffer.data() + sizeof(header));
+        float* scales = reinterpret_cast<float*>(lengths + segments.size());
+        torch::Tensor q = blob(reinterpret_cast<char*>(scales + segments.size()), numel, torch::kChar);
+
+        if (feedback)
+          decoded = torch::empty_like(x);
+
+        int64_t offset = 0;
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+          int64_t n = segments[i];
+          torch::Tensor seg = x.narrow(0, offset, n);
+          torch::Tensor qseg = q.narrow(0, offset, n);
+
+          float scale = seg.abs().max().item<float>() / 127.0f;
+
+          lengths[i] = n;
+          scales[i] = scale;
+
+          if (scale > 0.0f)
+            qseg.copy_(seg.div(scale).round_().clamp_(-127, 127));
+          else
+            qseg.zero_();
+
+          if (feedback)
+            decoded.narrow(0, offset, n).copy_(qseg).mul_(scale);
+
+          offset += n;
+        }
+      }
+      break;
+    case CODEC_TOPK:
+      {
+        int64_t k = std::min(numel, std::max<int64_t>(1, topk_ratio * numel));
+
+        torch::Tensor indices = std::get<1>(x.abs().topk(k, 0, true, false));
+        torch::Tensor values = x.index_select(0, indices);
+
+        header.count = k;
+        buffer.resize(sizeof(header) + k * (sizeof(int32_t) + sizeof(float)));
+
+        blob(buffer.data() + sizeof(header), k, torch::kInt).copy_(indices);
+        blob(buffer.data() + sizeof(header) + k * sizeof(int32_t), k, torch::kFloat).copy_(values);
+
+        if (feedback)
+          decoded = torch::zeros_like(x).index_put_({indices}, values);
+      }
+      break;
+    default:
+      throw runtime_error("unknown update codec");
+  }
+
+  memcpy(buffer.data(), &header, sizeof(header));
+
+  if (feedback)
+  {
+    residual->resize(numel * sizeof(float));
+    blob(residual->data(), numel, torch::kFloat).copy_(x - decoded);
+  }
+
+  return buffer;
+}
+
+void apply_update(const char* data, size_t size, torch::Tensor dest, float weight, uint64_t schema)
+{
+  torch::NoGradGuard no_grad;
+
+  if (size < sizeof(UpdateHeader))
+    throw runtime_error("update buffer too small");
+
+  UpdateHeader header;
+  memcpy(&header, data, sizeof(header));
+
+  if (header.magic != UPDATE_WIRE_MAGIC)
+    throw runtime_error("unknown update wire format");
+  if (header.schema != schema)
+    throw runtime_error("update layout mismatch");
+  if ((int64_t) header.numel != dest.numel())
+    throw runtime_error("update size mismatch");
+
+  const char* payload = data + sizeof(header);
+  size_t payload_size = size - sizeof(header);
+  int64_t numel = header.numel;
+
+  switch (header.codec)
+  {
+    case CODEC_FP32:
+      if (payload_size != numel * sizeof(float))
+        throw runtime_error("corrupt fp32 update");
+
+      dest.add_(blob(payload, numel, torch::kFloat), weight);
+      break;
+    case CODEC_FP16:
+      if (payload_size != numel * 2)
+        throw runtime_error("corrupt fp16 update");
+
+      dest.add_(blob(payload, numel, torch::kHalf).to(torch::kFloat), weight);
+      break;
+    case CODEC_INT8:
+      {
+        if (payload_size != header.segments * (sizeof(int64_t) + sizeof(float)) + numel)
+          throw runtime_error("corrupt int8 update");
+
+        const int64_t* lengths = reinterpret_cast<const int64_t*>(payload);
+        const float* scales = reinterpret_cast<const float*>(lengths + header.segments);
+        const char* q = reinterpret_cast<const char*>(scales + header.segments);
+
+        int64_t offset = 0;
+        for (uint64_t i = 0; i < header.segments; i++)
+        {
+          int64_t n = lengths[i];
+
+          if (offset + n > numel)
+            throw runtime_error("corrupt int8 update");
+
+          dest.narrow(0, offset, n).add_(blob(q + offset, n, torch::kChar).to(torch::kFloat), scales[i] * weight);
+          offset += n;
+        }
+      }
+      break;
+    case CODEC_TOPK:
+      {
+        int64_t k = header.count;
+
+        if (payload_size != k * (sizeof(int32_t) + sizeof(float)))
+          throw runtime_error("corrupt top-k update");
+
+        torch::Tensor indices = blob(payload, k, torch::kInt);
+        torch::Tensor values = blob(payload + k * sizeof(int32_t), k, torch::kFloat);
+
+        // Scatter straight into the destination.
+        dest.index_add_(0, indices, values.mul(weight));
+      }
+      break;
+    default:
+      throw runtime_error("unknown update codec");
+  }
+}
+
+double update_norm(const char* data, size_t size)
+{
+  torch::NoGradGuard no_grad;
+
+  if (size < sizeof(UpdateHeader))
+    throw runtime_error("update buffer too small");
+
+  UpdateHeader header;
+  memcpy(&header, data, sizeof(header));
+
+  if (header.magic != UPDATE_WIRE_MAGIC)
+    throw runtime_error("unknown update wire format");
+
+  const char* payload = data + sizeof(header);
+  size_t payload_size = size - sizeof(header);
+  int64_t numel = header.numel;
+
+  switch (header.codec)
+  {
+    case CODEC_FP32:
+      if (payload_size != numel * sizeof(float))
+        throw runtime_error("corrupt fp32 update");
+
+      return blob(payload, numel, torch::kFloat).norm().item<double>();
+    case CODEC_FP16:
+      if (payload_size != numel * 2)
+        throw runtime_error("corrupt fp16 update");
+
+      return blob(payload, numel, torch::kHalf).to(torch::kFloat).norm().item<double>();
+    case CODEC_INT8:
+      {
+        if (payload_size != header.segments * (sizeof(int64_t) + sizeof(float)) + numel)
+          throw runtime_error("corrupt int8 update");
+
+        const int64_t* lengths = reinterpret_cast<const int64_t*>(payload);
+        const float* scales = reinterpret_cast<const float*>(lengths + header.segments);
+        const char* q = reinterpret_cast<const char*>(scales + header.segments);
+
+        // Sum of squares per segment, rescaled by the segment scale
+        double sq = 0;
+        int64_t offset = 0;
+        for (uint64_t i = 0; i < header.segments; i++)
+        {
+          int64_t n = lengths[i];
+
+          if (offset + n > numel)
+            throw runtime_error("corrupt int8 update");
+
+          double norm = blob(q + offset, n, torch::kChar).to(torch::kFloat).norm().item<double>();
+          sq += norm * norm * scales[i] * scales[i];
+          offset += n;
+        }
+
+        return sqrt(sq);
+      }
+    case CODEC_TOPK:
+      {
+        int64_t k = header.count;
+
+        if (payload_size != k * (sizeof(int32_t) + sizeof(float)))
+          throw runtime_error("corrupt top-k update");
+
+        return blob(payload + k * sizeof(int32_t), k, torch::kFloat).norm().item<double>();
+      }
+    default:
+      throw runtime_error("unknown update codec");
+  }
+}
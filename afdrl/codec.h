@@ -0,0 +1,116 @@
+/**
+ * @file codec.h
+ * @brief Compressed model update codecs
+ */
+
+#ifndef AFDRL_CODEC_H
+#define AFDRL_CODEC_H
+
+#include "torch_pch.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Encodings for model deltas sent from workers to the scheduler.
+ */
+enum UpdateCodec
+{
+  CODEC_FP32, // dense float32
+  CODEC_FP16, // dense float16
+  CODEC_INT8, // dense int8 with one scale per parameter tensor
+  CODEC_TOPK, // sparse (index, value) pairs of the largest magnitudes
+};
+
+// Update wire format identification ("AFDU").
+static const uint32_t UPDATE_WIRE_MAGIC = 0x55444641;
+
+/**
+ * Header preceding an encoded update.
+ *
+ * Payload layouts:
+ *   CODEC_FP32: float[numel]
+ *   CODEC_FP16: half[numel]
+ *   CODEC_INT8: int64 lengths[segments], float scales[segments], int8[numel]
+ *   CODEC_TOPK: int32 indices[count], float values[count]
+ */
+struct UpdateHeader
+{
+  uint32_t magic;    // UPDATE_WIRE_MAGIC
+  uint32_t codec;    // UpdateCodec
+  uint64_t schema;   // LSTMModel::schema_hash() of the sender
+  uint64_t numel;    // dense element count
+  uint64_t count;    // encoded element count
+  uint64_t segments; // number of per-tensor scales
+};
+
+/**
+ * Parses a codec name.
+ *
+ * @param name The codec name (fp32, fp16, int8, topk).
+ * @return The codec.
+ */
+UpdateCodec parse_codec(const std::string& name);
+
+/**
+ * Encodes flat model deltas. With error feedback, whatever a lossy codec
+ * drops is returned as a residual (float[numel]) to be added to the same
+ * client's next delta instead of being lost. Residuals are client state
+ * like the optimizer state: they travel through the scheduler with the
+ * client's jobs, since a client rarely runs twice on the same rank.
+ */
+class UpdateEncoder
+{
+public:
+    /**
+     * Constructs an encoder.
+     *
+     * @param codec The codec to use.
+     * @param topk_ratio Fraction of elements kept by CODEC_TOPK.
+     * @param error_feedback Whether to return residuals.
+     */
+    UpdateEncoder(UpdateCodec codec, float topk_ratio, bool error_feedback);
+
+    /**
+     * Encodes a flat float32 delta. Safe to call from several threads.
+     *
+     * @param delta The flat delta (CPU).
+     * @param segments Element counts of each parameter tensor, in order.
+     * @param schema The model schema hash.
+     * @param residual The client's residual from its previous update, or
+     *        empty; replaced by what this encoding drops, or cleared without
+     *        error feedback. May be null if there is none to keep.
+     * @return The encoded update.
+     */
+    std::vector<char> encode(const torch::Tensor& delta, const std::vector<int64_t>& segments, uint64_t schema,
+        std::vector<char>* residual = nullptr) const;
+
+private:
+    UpdateCodec codec;
+    float topk_ratio;
+    bool error_feedback;
+};
+
+/**
+ * Adds a weighted encoded update into a flat float32 buffer. Sparse updates
+ * are scattered directly without densifying.
+ *
+ * @param data The encoded update.
+ * @param size The encoded update size in bytes.
+ * @param dest The flat destination (CPU).
+ * @param weight The weight of the update.
+ * @param schema The expected model schema hash.
+ */
+void apply_update(const char* data, size_t size, torch::Tensor dest, float weight, uint64_t schema);
+
+/**
+ * Computes the L2 norm of the delta an encoded update decodes to.
+ *
+ * @param data The encoded update.
+ * @param size The encoded update size in bytes.
+ * @return The norm of the decoded update.
+ */
+double update_norm(const char* data, size_t size);
+
+#endif
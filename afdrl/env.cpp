@@ -4,7 +4,11 @@
  */
 
 #include "env.h"
+#include "log.h"
+#include "preprocess.h"
+#include "resetpool.h"
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
@@ -19,6 +23,7 @@ using namespace std;
 using namespace ale;
 
 AtariEnv::AtariEnv(const std::string &rom_path, EnvConfig config, int seed, bool display)
+  : frames(config.frame_stack, OBS_PACKED)
 {
   ale = new ale::ALEInterface();
 
@@ -26,6 +31,7 @@ AtariEnv::AtariEnv(const std::string &rom_path, EnvConfig config, int seed, bool
     seed = time(NULL);
 
   ale->setInt("random_seed", seed);
+  reset_rng.seed(seed);
   ale->setBool("display_screen", display);
   ale->loadROM(rom_path);
 
@@ -34,79 +40,216 @@ AtariEnv::AtariEnv(const std::string &rom_path, EnvConfig config, int seed, bool
   screen_channels = config.frame_stack;
   num_actions = ale->getMinimalActionSet().size();
 
+  if (config.crop_x < 0 || config.crop_y < 0
+      || config.crop_x + config.crop_width > screen_width
+      || config.crop_y + config.crop_height > screen_height)
+    throw runtime_error("crop exceeds the screen bounds");
+
+  // Indices cannot be max pooled, only their colours
+  if (config.preprocess == PREPROCESS_PALETTE && config.max_pool)
+  {
+    log_warn("max pooling needs RGB screens, falling back to fused preprocessing");
+    config.preprocess = PREPROCESS_FUSED;
+  }
+
+  // The fused kernels only implement the exact 2x downsample.
+  if ((config.preprocess == PREPROCESS_FUSED || config.preprocess == PREPROCESS_PALETTE)
+      && !preprocess_fused_supported(config.crop_width, config.crop_height))
+  {
+    log_warn("fused preprocessing needs a %dx%d crop, falling back to OpenCV", 2 * OBS_SIZE, 2 * OBS_SIZE);
+    config.preprocess = PREPROCESS_OPENCV;
+  }
+
+  if (config.preprocess == PREPROCESS_PALETTE)
+  {
+    // Colour every index through the emulator's own palette (NTSC, PAL or
+    // SECAM, as the game needs), once
+    uint8_t indices[256], palette_rgb[256 * 3];
+
+    for (int i = 0; i < 256; i++)
+      indices[i] = i;
+
+    ale->theOSystem->colourPalette().applyPaletteRGB(palette_rgb, indices, 256);
+    palette_gray_lut(palette_rgb, gray_lut);
+  }
+
+  screen_rgb.resize(screen_width * screen_height * 3);
+
+  if (config.max_pool)
+    prev_rgb.resize(screen_rgb.size());
+
+  state = torch::empty({config.frame_stack, OBS_PACKED}, torch::kByte);
+
   this->config = config;
   reset();
 }
 
-torch::Tensor AtariEnv::observe()
+void AtariEnv::observe(uint8_t* out)
 {
+  if (config.preprocess == PREPROCESS_PALETTE)
+  {
+    // Read the indexed screen in place, a third of the RGB bytes
+    preprocess_indexed_fused(ale->getScreen().getArray(), screen_width,
+        config.crop_x, config.crop_y, gray_lut, out);
+    return;
+  }
+
   // Get the screen data in full color
-  vector<unsigned char> data;
-  ale->getScreenRGB(data);
+  ale->getScreenRGB(screen_rgb);
+
+  if (!config.max_pool)
+  {
+    preprocess(screen_rgb.data(), out);
+    return;
+  }
+
+  if (has_prev)
+  {
+    // Pool into the previous screen, which is not needed afterwards
+    for (size_t i = 0; i < prev_rgb.size(); i++)
+      prev_rgb[i] = std::max(prev_rgb[i], screen_rgb[i]);
+
+    preprocess(prev_rgb.data(), out);
+  } else {
+    preprocess(screen_rgb.data(), out);
+  }
+
+  // The raw screen pairs with the next observation
+  screen_rgb.swap(prev_rgb);
+  has_prev = true;
+}
+
+void AtariEnv::grab_screen()
+{
+  ale->getScreenRGB(prev_rgb);
+  has_prev = true;
+}
+
+void AtariEnv::preprocess(const uint8_t* rgb, uint8_t* out)
+{
+  if (config.preprocess == PREPROCESS_FUSED)
+  {
+    // Crop, gray, downsample, threshold and pack in a single pass
+    preprocess_rgb_fused(rgb, screen_width, config.crop_x, config.crop_y, out);
+    return;
+  }
 
-  // Convert the screen data to a cv::Mat
-  cv::Mat image(screen_height, screen_width, CV_8UC3, data.data());
+  // Convert the screen data to a cv::Mat (read only)
+  cv::Mat image(screen_height, screen_width, CV_8UC3, const_cast<uint8_t*>(rgb));
 
   // Convert the RGB to Y channel
-  cv::Mat y_channel;
-  cv::cvtColor(image, y_channel, cv::COLOR_RGB2GRAY);
+  cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
 
   // Crop the image with the env config (left, top, right, bottom)
-  cv::Mat cropped = y_channel(cv::Rect(config.crop_x, config.crop_y, config.crop_width, config.crop_height));
+  cv::Mat cropped = gray(cv::Rect(config.crop_x, config.crop_y, config.crop_width, config.crop_height));
 
   // Resize the image to the desired size
-  cv::Mat resized;
-  cv::resize(cropped, resized, cv::Size(80, 80),
+  cv::resize(cropped, resized, cv::Size(OBS_SIZE, OBS_SIZE),
              cv::INTER_LINEAR);
 
-  // Apply binary threshold
-  cv::threshold(resized, resized, 128, 255, cv::THRESH_BINARY);
-
-  // Convert the cv::Mat to a torch tensor
-  return torch::from_blob(resized.data, {1, 80, 80}, torch::TensorOptions().dtype(torch::kByte)).toType(torch::kFloat).div(255);
+  // Apply binary threshold, then keep one bit per pixel
+  cv::threshold(resized, binary, 128, 255, cv::THRESH_BINARY);
+  pack_obs(binary.ptr<uint8_t>(), out);
 }
 
 AtariEnv::~AtariEnv() { delete ale; }
 
 torch::Tensor AtariEnv::reset() {
-  ale->reset_game();
-
-  // Clear the frame skip deque
-  frame_stack_deque.clear();
-
-  torch::Tensor obs = observe();
-
-  // Initialize the frame skip deque with the initial screen
-  for (int i = 0; i < config.frame_stack; i++) {
-    frame_stack_deque.push_back(obs);
+  if (reset_pool)
+  {
+    // Restore a pre-generated start state and its frame stack
+    int i = reset_rng() % reset_pool->size();
+    deserialize(reset_pool->state(i), reset_pool->state_size(i));
+    return state;
   }
 
-  // Return the concatenated frames from the frame skip deque
-  std::vector<torch::Tensor> frame_stack_deque_vec(frame_stack_deque.begin(),
-                                                  frame_stack_deque.end());
+  ale->reset_game();
+  has_prev = false;
 
-  return torch::cat(frame_stack_deque_vec);
+  // Initialize every slot of the frame stack with the initial screen
+  observe(frames.push());
+  frames.fill();
+
+  frames.copy_to(state.data_ptr<uint8_t>());
+  return state;
 }
 
 std::tuple<torch::Tensor, float, bool> AtariEnv::step(int action) {
   // Get the minimal action set
   const ActionVect &actions = ale->getMinimalActionSet();
 
+  // Frames observed before the last frame_stack ones would be evicted by
+  // the later pushes, so only those are rendered (plus, with max pooling,
+  // the screen just before them).
+  int first = std::max(0, config.frame_skip - frames.get_depth());
+
   // Perform the action for the number of frame skips
   float reward = 0;
 
   for (int i = 0; i < config.frame_skip; i++) {
     reward += ale->act(actions[action]);
 
-    frame_stack_deque.push_front(observe());
-    frame_stack_deque.pop_back();
+    if (i >= first)
+      observe(frames.push());
+    else if (config.max_pool && i == first - 1)
+      grab_screen();
   }
 
   bool terminal = ale->game_over();
 
-  // Return the concatenated frames from the frame skip deque
-  std::vector<torch::Tensor> frame_stack_deque_vec(frame_stack_deque.begin(),
-                                                  frame_stack_deque.end());
-  return std::make_tuple(torch::cat(frame_stack_deque_vec), reward,
-                         terminal);
+  // Lay the frame stack out contiguously, newest frame first
+  frames.copy_to(state.data_ptr<uint8_t>());
+  return std::make_tuple(state, reward, terminal);
+}
+
+std::vector<char> AtariEnv::serialize(bool include_rng) const {
+  // With the random generator, sticky actions replay identically
+  std::string ale_state = ale->cloneState(include_rng).serialize();
+
+  EnvStateHeader header;
+  header.magic = ENV_WIRE_MAGIC;
+  header.depth = frames.get_depth();
+  header.frame_size = frames.get_frame_size();
+  header.ale_bytes = ale_state.size();
+
+  std::vector<char> buffer(sizeof(header) + ale_state.size() + (size_t) header.depth * header.frame_size);
+  char* out = buffer.data();
+
+  memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+
+  memcpy(out, ale_state.data(), ale_state.size());
+  out += ale_state.size();
+
+  frames.copy_to(reinterpret_cast<uint8_t*>(out));
+
+  return buffer;
+}
+
+void AtariEnv::deserialize(const char* data, size_t size) {
+  EnvStateHeader header;
+
+  if (size < sizeof(header))
+    throw runtime_error("environment state too small");
+
+  memcpy(&header, data, sizeof(header));
+
+  if (header.magic != ENV_WIRE_MAGIC)
+    throw runtime_error("bad environment state magic");
+  if ((int) header.depth != frames.get_depth() || (int) header.frame_size != frames.get_frame_size())
+    throw runtime_error("environment state frame stack mismatch");
+  if (size != sizeof(header) + header.ale_bytes + (size_t) header.depth * header.frame_size)
+    throw runtime_error("environment state size mismatch");
+
+  const char* in = data + sizeof(header);
+
+  ale::ALEState ale_state(std::string(in, header.ale_bytes));
+  ale->restoreState(ale_state);
+  in += header.ale_bytes;
+
+  frames.copy_from(reinterpret_cast<const uint8_t*>(in));
+  frames.copy_to(state.data_ptr<uint8_t>());
+
+  // The restored emulator has no rendered screen to pool with
+  has_prev = false;
 }
@@ -8,9 +8,25 @@
 
 #include "torch_pch.h"
 #include <ale/ale_interface.hpp>
-#include <deque>
+#include <cstdint>
+#include <memory>
+#include <random>
 #include <vector>
 
+#include <opencv2/core.hpp>
+
+#include "framestack.h"
+
+/**
+ * Observation preprocessing backends.
+ */
+enum Preprocess
+{
+  PREPROCESS_OPENCV,  // cvtColor + resize + threshold through OpenCV
+  PREPROCESS_FUSED,   // single-pass SIMD kernel (see preprocess.h)
+  PREPROCESS_PALETTE, // single pass over palette indices through a gray table
+};
+
 struct EnvConfig
 {
   int frame_skip = 3;
@@ -21,6 +37,28 @@ struct EnvConfig
   int crop_y = 0;
   int crop_width = 0;
   int crop_height = 0;
+
+  Preprocess preprocess = PREPROCESS_FUSED;
+
+  // Observe the per-channel max of each screen and the one before it
+  bool max_pool = false;
+};
+
+class ResetPool;
+
+// Environment state wire format identification ("AFDE").
+static const uint32_t ENV_WIRE_MAGIC = 0x45444641;
+
+/**
+ * Header preceding a serialized environment state. The ALE state bytes
+ * follow, then the frame stack, newest frame first.
+ */
+struct EnvStateHeader
+{
+  uint32_t magic;      // ENV_WIRE_MAGIC
+  uint32_t depth;      // frames in the stack
+  uint32_t frame_size; // bytes per frame
+  uint32_t ale_bytes;  // size of the serialized ALE state
 };
 
 /**
@@ -45,7 +83,13 @@ public:
     ~AtariEnv();
 
     /**
-     * Resets the environment.
+     * Resets the environment. With a reset pool, the episode starts from one
+     * of its states, picked by a generator seeded with the environment seed.
+     *
+     * States are [frame_stack, OBS_PACKED] uint8 tensors of bit-packed 80x80
+     * frames (see preprocess.h, newest frame first) held in a buffer owned
+     * by the environment, which is rewritten by the next reset() or step().
+     * Convert them with LSTMModel::input().
      * 
      * @return The initial state.
      */
@@ -53,9 +97,12 @@ public:
 
     /**
      * Steps the environment.
+     *
+     * Only the last frame_stack of the frame_skip emulated frames can reach
+     * the returned state, so the earlier ones are never rendered.
      * 
      * @param action The action to take.
-     * @return The next state, reward received, and terminal state.
+     * @return The next state (see reset()), reward received, and terminal state.
      */
     std::tuple<torch::Tensor, float, bool> step(int action);
 
@@ -88,26 +135,68 @@ public:
     int get_screen_channels() const { return screen_channels; }
 
     /**
-     * Serializes the environment state into a buffer.
+     * Get the current state (see reset()).
+     *
+     * @return The current state.
+     */
+    const torch::Tensor& get_state() const { return state; }
+
+    /**
+     * Serializes the environment state into a buffer: the ALE emulator
+     * state and the frame stack.
      * 
+     * @param include_rng Whether to include the emulator's random generator.
      * @return The buffer containing the serialized environment state.
      */
-    std::vector<char> serialize() const;
+    std::vector<char> serialize(bool include_rng = true) const;
+
+    /**
+     * Deserializes the environment state from a buffer produced by an
+     * environment of the same game and configuration. The episode then
+     * continues exactly where the serialized one was.
+     * 
+     * @param data The serialized environment state.
+     * @param size The size of the serialized state in bytes.
+     */
+    void deserialize(const char* data, size_t size);
 
     /**
      * Deserializes the environment state from a buffer.
      * 
      * @param buffer The buffer containing the serialized environment state.
      */
-    void deserialize(const std::vector<char>& buffer);
+    void deserialize(const std::vector<char>& buffer) { deserialize(buffer.data(), buffer.size()); }
+
+    /**
+     * Starts every following episode from a state of a shared pool.
+     *
+     * @param pool The reset pool, generated for this game and config.
+     */
+    void set_reset_pool(std::shared_ptr<const ResetPool> pool) { reset_pool = pool; }
 
 private:
     /**
-     * Observes the environment.
+     * Observes the environment, writing the preprocessed, bit-packed 80x80
+     * frame into a caller-provided buffer. With max pooling, the screen is
+     * first maxed with the previously grabbed one, if any.
      * 
-     * @return The current state.
+     * @param out The output buffer, OBS_PACKED bytes.
+     */
+    void observe(uint8_t* out);
+
+    /**
+     * Keeps the current screen as the max pooling partner of the next
+     * observation, without preprocessing it.
+     */
+    void grab_screen();
+
+    /**
+     * Preprocesses an RGB screen into a bit-packed 80x80 frame.
+     *
+     * @param rgb The screen, screen_width * screen_height * 3 bytes.
+     * @param out The output buffer, OBS_PACKED bytes.
      */
-    torch::Tensor observe();
+    void preprocess(const uint8_t* rgb, uint8_t* out);
 
     // Configuration
     EnvConfig config;
@@ -118,8 +207,26 @@ private:
     // Environment parameters
     int num_actions, screen_height, screen_width, screen_channels;
 
-    // Deque of recent observations
-    std::deque<torch::Tensor> frame_stack_deque;
+    // Ring of recent observations
+    FrameStack frames;
+
+    // Contiguous stacked state returned to callers
+    torch::Tensor state;
+
+    // Optional start states, and the generator picking them
+    std::shared_ptr<const ResetPool> reset_pool;
+    std::minstd_rand reset_rng;
+
+    // Gray level of each palette index (palette preprocessing)
+    uint8_t gray_lut[256];
+
+    // Reused screen and preprocessing buffers
+    std::vector<unsigned char> screen_rgb;
+    cv::Mat gray, resized, binary;
+
+    // Previous screen for max pooling, and whether it belongs to this episode
+    std::vector<unsigned char> prev_rgb;
+    bool has_prev = false;
 };
 
 
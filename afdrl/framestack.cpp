@@ -0,0 +1,53 @@
+/**
+ * @file framestack.cpp
+ * @brief Preallocated circular frame stack
+ */
+
+#include "framestack.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+FrameStack::FrameStack(int depth, int frame_size)
+  : depth(depth), frame_size(frame_size), frames(depth * frame_size, 0)
+{
+  if (depth < 1)
+    throw runtime_error("frame stack depth must be positive");
+}
+
+uint8_t* FrameStack::push()
+{
+  head = (head + 1) % depth;
+  return frames.data() + head * frame_size;
+}
+
+void FrameStack::fill()
+{
+  const uint8_t* newest = frames.data() + head * frame_size;
+
+  for (int i = 0; i < depth; i++)
+    if (i != head)
+      memcpy(frames.data() + i * frame_size, newest, frame_size);
+}
+
+void FrameStack::copy_to(uint8_t* out) const
+{
+  // Walk backwards from the head so the newest frame comes first.
+  for (int i = 0; i < depth; i++)
+  {
+    int slot = (head - i + depth) % depth;
+    memcpy(out + i * frame_size, frames.data() + slot * frame_size, frame_size);
+  }
+}
+
+void FrameStack::copy_from(const uint8_t* in)
+{
+  // Newest frame at the head, older ones behind it, as copy_to() reads them.
+  for (int i = 0; i < depth; i++)
+  {
+    int slot = (head - i + depth) % depth;
+    memcpy(frames.data() + slot * frame_size, in + i * frame_size, frame_size);
+  }
+}
@@ -0,0 +1,77 @@
+/**
+ * @file framestack.h
+ * @brief Preallocated circular frame stack
+ */
+
+#ifndef AFDRL_FRAMESTACK_H
+#define AFDRL_FRAMESTACK_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Fixed-capacity ring of preprocessed uint8 frames. Pushing a frame only
+ * advances the ring head, so no memory is allocated after construction.
+ */
+class FrameStack {
+public:
+    /**
+     * Constructs a frame stack.
+     *
+     * @param depth The number of frames kept.
+     * @param frame_size The size of a single frame in bytes.
+     */
+    FrameStack(int depth, int frame_size);
+
+    /**
+     * Makes room for a new frame, evicting the oldest one.
+     *
+     * @return The slot the caller must write the newest frame into.
+     */
+    uint8_t* push();
+
+    /**
+     * Replicates the newest frame into every slot.
+     */
+    void fill();
+
+    /**
+     * Copies the stack into a contiguous buffer, newest frame first.
+     *
+     * @param out The output buffer, depth * frame_size bytes.
+     */
+    void copy_to(uint8_t* out) const;
+
+    /**
+     * Replaces the stack with frames laid out as by copy_to().
+     *
+     * @param in The input buffer, depth * frame_size bytes, newest frame first.
+     */
+    void copy_from(const uint8_t* in);
+
+    /**
+     * Get the number of frames kept.
+     *
+     * @return The stack depth.
+     */
+    int get_depth() const { return depth; }
+
+    /**
+     * Get the size of a single frame.
+     *
+     * @return The frame size in bytes.
+     */
+    int get_frame_size() const { return frame_size; }
+
+private:
+    // Stack geometry
+    int depth, frame_size;
+
+    // Slot holding the newest frame
+    int head = 0;
+
+    // Frame storage, depth * frame_size bytes
+    std::vector<uint8_t> frames;
+};
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file inference.cpp
+ * @brief Frozen, BatchNorm-folded copy of LSTMModel for evaluation
+ */
+
+#include "inference.h"
+#include "log.h"
+
+using namespace std;
+
+/**
+ * Writes conv followed by an eval-mode BatchNorm into one convolution:
+ * w' = w * s, b' = (b - mean) * s + beta, with s = gamma / sqrt(var + eps).
+ */
+static void fold(torch::nn::Conv2d& dest, const torch::nn::Conv2d& conv, const torch::nn::BatchNorm2d& bn)
+{
+  torch::Tensor scale = bn->weight / torch::sqrt(bn->running_var + bn->options.eps());
+
+  dest->weight.copy_(conv->weight * scale.view({-1, 1, 1, 1}));
+  dest->bias.copy_((conv->bias - bn->running_mean) * scale + bn->bias);
+}
+
+InferenceModel::InferenceModel(int envs, torch::Device device)
+  : device(device)
+{
+  hx = torch::zeros({envs, 512}, torch::TensorOptions().device(device));
+  cx = torch::zeros({envs, 512}, torch::TensorOptions().device(device));
+}
+
+void InferenceModel::load(LSTMModel& model, int version)
+{
+  if (version == this->version && conv1)
+    return;
+
+  torch::NoGradGuard no_grad;
+
+  if (!conv1)
+  {
+    // Same shapes as the model; the values are overwritten below
+    conv1 = torch::nn::Conv2d(model.conv1->options);
+    conv2 = torch::nn::Conv2d(model.conv2->options);
+    conv3 = torch::nn::Conv2d(model.conv3->options);
+    conv4 = torch::nn::Conv2d(model.conv4->options);
+    lstm = torch::nn::LSTMCell(model.lstm->options);
+    actor_linear = torch::nn::Linear(model.actor_linear->options);
+    critic_linear = torch::nn::Linear(model.critic_linear->options);
+
+    for (torch::nn::Module* m : std::initializer_list<torch::nn::Module*>{
+        conv1.get(), conv2.get(), conv3.get(), conv4.get(),
+        lstm.get(), actor_linear.get(), critic_linear.get()})
+    {
+      m->to(device);
+
+      for (auto& param : m->parameters())
+        param.requires_grad_(false);
+    }
+  }
+
+  fold(conv1, model.conv1, model.bn1);
+  fold(conv2, model.conv2, model.bn2);
+  fold(conv3, model.conv3, model.bn3);
+
+  conv4->weight.copy_(model.conv4->weight);
+  conv4->bias.copy_(model.conv4->bias);
+
+  lstm->weight_ih.copy_(model.lstm->weight_ih);
+  lstm->weight_hh.copy_(model.lstm->weight_hh);
+  lstm->bias_ih.copy_(model.lstm->bias_ih);
+  lstm->bias_hh.copy_(model.lstm->bias_hh);
+
+  actor_linear->weight.copy_(model.actor_linear->weight);
+  actor_linear->bias.copy_(model.actor_linear->bias);
+  critic_linear->weight.copy_(model.critic_linear->weight);
+  critic_linear->bias.copy_(model.critic_linear->bias);
+
+  this->version = version;
+
+  log_debug("Inference model rebuilt for version %d", version);
+}
+
+torch::Tensor InferenceModel::step(const torch::Tensor& frames)
+{
+  torch::InferenceMode guard;
+
+  torch::Tensor x = LSTMModel::input(frames.to(device));
+
+  x = torch::max_pool2d(torch::relu_(conv1->forward(x)), 2);
+  x = torch::max_pool2d(torch::relu_(conv2->forward(x)), 2);
+  x = torch::max_pool2d(torch::relu_(conv3->forward(x)), 2);
+  x = torch::max_pool2d(torch::relu_(conv4->forward(x)), 2);
+  x = x.view({x.size(0), -1});
+
+  auto lstm_out = lstm->forward(x, std::make_tuple(hx, cx));
+
+  hx.copy_(std::get<0>(lstm_out));
+  cx.copy_(std::get<1>(lstm_out));
+
+  // As in LSTMModel::forward, the heads read the trunk features
+  value = critic_linear->forward(x);
+
+  return actor_linear->forward(x);
+}
+
+void InferenceModel::reset_hidden()
+{
+  hx.zero_();
+  cx.zero_();
+}
+
+void InferenceModel::reset_hidden(int env)
+{
+  hx[env].zero_();
+  cx[env].zero_();
+}
@@ -0,0 +1,80 @@
+/**
+ * @file inference.h
+ * @brief Frozen, BatchNorm-folded copy of LSTMModel for evaluation
+ */
+
+#ifndef AFDRL_INFERENCE_H
+#define AFDRL_INFERENCE_H
+
+#include "model.h"
+
+/**
+ * Evaluation-only copy of an LSTMModel. bn1-bn3 are folded into conv1-conv3
+ * with their running statistics, matching the model's eval() forward with
+ * three fewer passes over the activations. It runs under InferenceMode and
+ * keeps its hidden state in buffers allocated once.
+ *
+ * The copy is only rebuilt by load() when a new model version arrives.
+ */
+class InferenceModel
+{
+public:
+    /**
+     * Allocates the hidden state buffers. The layers are created by the
+     * first load().
+     *
+     * @param envs Batch size of every step().
+     * @param device Device to run on.
+     */
+    InferenceModel(int envs, torch::Device device);
+
+    /**
+     * Rebuilds the folded weights from a model, unless they already hold
+     * this version.
+     *
+     * @param model The model, whose BatchNorm running statistics are used.
+     * @param version Global model version of its parameters.
+     */
+    void load(LSTMModel& model, int version);
+
+    /**
+     * Runs one step over the batch, advancing the hidden state.
+     *
+     * @param frames Stacked packed frames [envs, C, OBS_PACKED].
+     * @return torch::Tensor The policy logits [envs, n_actions].
+     */
+    torch::Tensor step(const torch::Tensor& frames);
+
+    /**
+     * Values of the last step [envs, 1].
+     */
+    const torch::Tensor& get_value() const { return value; }
+
+    /**
+     * Zeroes the hidden state of every environment.
+     */
+    void reset_hidden();
+
+    /**
+     * Zeroes the hidden state of one environment.
+     */
+    void reset_hidden(int env);
+
+    int get_version() const { return version; }
+
+private:
+    int version = -1;
+    torch::Device device;
+
+    // Folded convolutions and the untouched tail of the model
+    torch::nn::Conv2d conv1 = nullptr, conv2 = nullptr, conv3 = nullptr, conv4 = nullptr;
+    torch::nn::LSTMCell lstm = nullptr;
+    torch::nn::Linear actor_linear = nullptr, critic_linear = nullptr;
+
+    // Hidden state [envs, 512], updated in place
+    torch::Tensor hx, cx;
+
+    torch::Tensor value;
+};
+
+#endif
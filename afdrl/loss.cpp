@@ -0,0 +1,81 @@
+/**
+ * @file loss.cpp
+ * @brief Batched A3C rollout losses
+ */
+
+#include "loss.h"
+
+using namespace std;
+
+void discounted_targets(const torch::Tensor& rewards, const torch::Tensor& masks,
+    const torch::Tensor& values, const torch::Tensor& bootstrap, float gamma, float tau,
+    torch::Tensor& returns, torch::Tensor& advantages)
+{
+  torch::NoGradGuard no_grad;
+
+  int64_t T = rewards.size(0);
+  int64_t N = rewards.size(1);
+
+  torch::Tensor r = rewards.to(torch::kFloat).contiguous();
+  torch::Tensor m = masks.to(torch::kFloat).contiguous();
+  torch::Tensor v = values.to(torch::kFloat).contiguous();
+  torch::Tensor b = bootstrap.to(torch::kFloat).contiguous();
+
+  returns = torch::empty({T, N});
+  advantages = torch::empty({T, N});
+
+  const float* r_p = r.data_ptr<float>();
+  const float* m_p = m.data_ptr<float>();
+  const float* v_p = v.data_ptr<float>();
+  float* ret_p = returns.data_ptr<float>();
+  float* adv_p = advantages.data_ptr<float>();
+
+  for (int64_t n = 0; n < N; n++)
+  {
+    float R = b.data_ptr<float>()[n];
+    float next_value = R;
+    float gae = 0;
+
+    for (int64_t t = T - 1; t >= 0; t--)
+    {
+      int64_t i = t * N + n;
+
+      R = r_p[i] + gamma * R * m_p[i];
+
+      float delta = r_p[i] + gamma * next_value * m_p[i] - v_p[i];
+      gae = gae * gamma * tau * m_p[i] + delta;
+
+      ret_p[i] = R;
+      adv_p[i] = gae;
+
+      next_value = v_p[i];
+    }
+  }
+}
+
+RolloutLoss a3c_loss(const torch::Tensor& log_probs, const torch::Tensor& values,
+    const torch::Tensor& entropies, const torch::Tensor& rewards, const torch::Tensor& masks,
+    const torch::Tensor& bootstrap, float gamma, float tau, float entropy_coef)
+{
+  // One device transfer of the detached values and bootstrap per rollout
+  torch::Tensor returns, advantages;
+  discounted_targets(
+      rewards, masks,
+      values.detach().to(torch::kCPU),
+      bootstrap.detach().to(torch::kCPU),
+      gamma, tau, returns, advantages);
+
+  returns = returns.to(values.device());
+  advantages = advantages.to(values.device());
+
+  torch::Tensor value_loss = 0.5f * (returns - values).pow(2).sum(0);
+  torch::Tensor policy_loss = -(log_probs * advantages).sum(0) - entropy_coef * entropies.sum(0);
+
+  RolloutLoss result;
+  result.loss = (policy_loss + 0.5f * value_loss).mean();
+  result.policy_loss = policy_loss.detach().mean();
+  result.value_loss = value_loss.detach().mean();
+  result.entropy = entropies.detach().mean();
+
+  return result;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file loss.h
+ * @brief Batched A3C rollout losses
+ */
+
+#ifndef AFDRL_LOSS_H
+#define AFDRL_LOSS_H
+
+#include "torch_pch.h"
+
+/**
+ * Losses of one rollout, summed over time and averaged over environments.
+ */
+struct RolloutLoss
+{
+  torch::Tensor loss;        // policy_loss + 0.5 * value_loss, with graph
+
+  torch::Tensor policy_loss; // detached
+  torch::Tensor value_loss;  // detached
+  torch::Tensor entropy;     // detached mean entropy over the rollout
+};
+
+/**
+ * Computes discounted returns and generalized advantage estimates for a
+ * rollout in one reverse scan on the host. Masks stop both from crossing
+ * episode boundaries.
+ *
+ * @param rewards Clipped rewards [T, N] (CPU).
+ * @param masks Continuation masks [T, N], 0 after a terminal step (CPU).
+ * @param values Value estimates [T, N] (CPU, detached).
+ * @param bootstrap Value estimates of the states after the rollout [N] (CPU).
+ * @param gamma The discount factor.
+ * @param tau The GAE factor.
+ * @param returns Output discounted returns [T, N].
+ * @param advantages Output advantages [T, N].
+ */
+void discounted_targets(const torch::Tensor& rewards, const torch::Tensor& masks,
+    const torch::Tensor& values, const torch::Tensor& bootstrap, float gamma, float tau,
+    torch::Tensor& returns, torch::Tensor& advantages);
+
+/**
+ * Computes the A3C loss of a rollout of T steps over N environments with a
+ * handful of batched ops. Only log_probs, values and entropies carry graph;
+ * the targets are built without autograd.
+ *
+ * @param log_probs Log probabilities of the taken actions [T, N].
+ * @param values Value estimates [T, N].
+ * @param entropies Policy entropies [T, N].
+ * @param rewards Clipped rewards [T, N] (CPU).
+ * @param masks Continuation masks [T, N] (CPU).
+ * @param bootstrap Value estimates of the states after the rollout [N].
+ * @param gamma The discount factor.
+ * @param tau The GAE factor.
+ * @param entropy_coef The entropy bonus weight.
+ * @return The rollout losses.
+ */
+RolloutLoss a3c_loss(const torch::Tensor& log_probs, const torch::Tensor& values,
+    const torch::Tensor& entropies, const torch::Tensor& rewards, const torch::Tensor& masks,
+    const torch::Tensor& bootstrap, float gamma, float tau, float entropy_coef);
+
+#endif
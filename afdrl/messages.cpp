@@ -0,0 +1,171 @@
+/**
+ * @file messages.cpp
+ * @brief Message layer between the scheduler, workers and testers
+ */
+
+#include "messages.h"
+
+#include <cstring>
+
+using namespace std;
+
+MessageLayer::MessageLayer(MPI_Comm comm)
+  : comm(comm)
+{
+}
+
+MessageLayer::~MessageLayer()
+{
+  flush();
+}
+
+void MessageLayer::post(int dest, PendingSend& send, const void* payload)
+{
+  // Describe the header and payload as one message without copying them
+  // together: a two-block datatype addressed from MPI_BOTTOM.
+  int lengths[2] = { (int) sizeof(MessageHeader), (int) send.header.length };
+  MPI_Aint displacements[2];
+
+  MPI_Get_address(&send.header, &displacements[0]);
+  MPI_Get_address(payload ? payload : &send.header, &displacements[1]);
+
+  MPI_Datatype type;
+  if (MPI_Type_create_hindexed(send.header.length ? 2 : 1, lengths, displacements, MPI_BYTE, &type))
+    throw runtime_error("MPI_Type_create_hindexed failed");
+  if (MPI_Type_commit(&type))
+    throw runtime_error("MPI_Type_commit failed");
+
+  if (MPI_Isend(MPI_BOTTOM, 1, type, dest, send.header.type, comm, &send.request))
+    throw runtime_error("MPI_Isend failed");
+
+  // Freeing is deferred by MPI until the send completes.
+  MPI_Type_free(&type);
+}
+
+void MessageLayer::send(int dest, const MessageHeader& header, const void* payload)
+{
+  sends.emplace_back();
+  PendingSend& send = sends.back();
+
+  send.header = header;
+  send.owned.assign((const char*) payload, (const char*) payload + (payload ? header.length : 0));
+
+  post(dest, send, send.owned.data());
+  progress();
+}
+
+void MessageLayer::send(int dest, MessageHeader header, std::vector<char>&& payload)
+{
+  sends.emplace_back();
+  PendingSend& send = sends.back();
+
+  header.length = payload.size();
+  send.header = header;
+  send.owned = std::move(payload);
+
+  post(dest, send, send.owned.data());
+  progress();
+}
+
+void MessageLayer::send(int dest, MessageHeader header, std::shared_ptr<const std::vector<char>> payload)
+{
+  sends.emplace_back();
+  PendingSend& send = sends.back();
+
+  header.length = payload->size();
+  send.header = header;
+  send.shared = payload;
+
+  post(dest, send, send.shared->data());
+  progress();
+}
+
+void MessageLayer::receive(Message& msg, MPI_Status& status)
+{
+  int count;
+  if (MPI_Get_count(&status, MPI_BYTE, &count))
+    throw runtime_error("MPI_Get_count failed");
+
+  if (count < (int) sizeof(MessageHeader))
+    throw runtime_error("message shorter than its header");
+
+  // Take a buffer from the pool; its capacity is kept across messages.
+  if (!pool.empty())
+  {
+    msg.buffer = std::move(pool.back());
+    pool.pop_back();
+  }
+
+  msg.buffer.resize(count);
+
+  if (MPI_Recv(msg.buffer.data(), count, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG, comm, MPI_STATUS_IGNORE))
+    throw runtime_error("MPI_Recv failed");
+
+  msg.source = status.MPI_SOURCE;
+  memcpy(&msg.header, msg.buffer.data(), sizeof(MessageHeader));
+
+  if (msg.header.length != count - sizeof(MessageHeader))
+    throw runtime_error("message length mismatch");
+}
+
+bool MessageLayer::poll(Message& msg, int source, int type)
+{
+  progress();
+
+  int flag;
+  MPI_Status status;
+
+  if (MPI_Iprobe(source, type, comm, &flag, &status))
+    throw runtime_error("MPI_Iprobe failed");
+
+  if (!flag)
+    return false;
+
+  receive(msg, status);
+  return true;
+}
+
+Message MessageLayer::recv(int source, int type)
+{
+  progress();
+
+  MPI_Status status;
+  if (MPI_Probe(source, type, comm, &status))
+    throw runtime_error("MPI_Probe failed");
+
+  Message msg;
+  receive(msg, status);
+
+  return msg;
+}
+
+void MessageLayer::recycle(Message& msg)
+{
+  if (msg.buffer.capacity())
+    pool.push_back(std::move(msg.buffer));
+
+  msg.buffer = std::vector<char>();
+}
+
+void MessageLayer::progress()
+{
+  for (auto it = sends.begin(); it != sends.end();)
+  {
+    int done;
+    if (MPI_Test(&it->request, &done, MPI_STATUS_IGNORE))
+      throw runtime_error("MPI_Test failed");
+
+    if (done)
+      it = sends.erase(it);
+    else
+      ++it;
+  }
+}
+
+void MessageLayer::flush()
+{
+  for (auto& send : sends)
+    MPI_Wait(&send.request, MPI_STATUS_IGNORE);
+
+  sends.clear();
+}
@@ -1,70 +1,232 @@
-#pragma once
+/**
+ * @file messages.h
+ * @brief Message layer between the scheduler, workers and testers
+ */
+
+#ifndef AFDRL_MESSAGES_H
+#define AFDRL_MESSAGES_H
 
 #include <mpi.h>
 
-#include <vector>
+#include <cstdint>
+#include <list>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 static const int MSG_GET_GLOBAL_MODEL = 0;
-static const int MSG_UPDATE_GLOBAL_MODEL = 4;
-static const int MSG_GLOBAL_MODEL = 0;
+static const int MSG_GLOBAL_MODEL = 1;
 static const int MSG_GET_SCHEDULE = 2;
 static const int MSG_SCHEDULE = 3;
+static const int MSG_UPDATE_GLOBAL_MODEL = 4;
 static const int MSG_STOP = 5;
 static const int MSG_SLEEP = 6;
+static const int MSG_OPTIM_STATE = 7;
+static const int MSG_CLIENT_STATE = 8;
+static const int MSG_FLUSH_UPDATES = 9;
+static const int MSG_COMBINED_UPDATE = 10;
+static const int MSG_RESIDUAL = 11;
+
+// How a reply carrying the global model delivers it (MessageHeader::model)
+static const int MODEL_INLINE = 0;  // in the payload, omitted if already held
+static const int MODEL_PUBLISH = 1; // in the payload, to be published to the node's window
+static const int MODEL_SHARED = 2;  // in the node's window (see sharedmodel.h)
 
 /**
- * Receive an integer from an MPI process.
+ * Header at the start of every message. The message type doubles as the MPI
+ * tag, so receivers can probe for a specific kind of message.
  *
- * @param source The MPI process to receive from.
- * @return The integer received.
+ * Model requests (MSG_GET_SCHEDULE, MSG_GET_GLOBAL_MODEL) carry the global
+ * model version the requester already holds, or -1. Replies carrying the
+ * model (MSG_SCHEDULE, MSG_GLOBAL_MODEL) carry the current version, and omit
+ * the payload when the requester already holds it. With a shared model,
+ * the model field says where the new version is found instead.
+ *
+ * Type-specific fields:
+ *   MSG_GET_GLOBAL_MODEL: arg[0] = n > 0 to be answered once a version newer
+ *                     than the one held has version % n == arg[1], or 0 to
+ *                     be answered at once
+ *   MSG_SCHEDULE:     arg[0] = number of steps, arg[1] = 1 if a
+ *                     MSG_OPTIM_STATE for the job follows, arg[2] = 1 if a
+ *                     MSG_CLIENT_STATE follows, arg[3] = 1 if a
+ *                     MSG_RESIDUAL follows
+ *   MSG_GLOBAL_MODEL: arg[0] = federation time, arg[1] = global update count,
+ *                     arg[2] = total trajectory count
+ *   MSG_UPDATE_GLOBAL_MODEL: version = global model version the update was
+ *                     trained from, payload = encoded update (see codec.h),
+ *                     or to the scheduler with arg[0] = 1 and no payload
+ *                     when the update went to the sender's sub-aggregator
+ *   MSG_FLUSH_UPDATES: payload = arg[0] SubAggregateEntry naming the held
+ *                     updates to sum, and their weights (see subaggregate.h)
+ *   MSG_COMBINED_UPDATE: payload = arg[0] SubAggregateEntry with the size and
+ *                     norm of each update, then their weighted sum, encoded
+ *   MSG_OPTIM_STATE:  payload = client optimizer state (see optim.h)
+ *   MSG_CLIENT_STATE: payload = client environment and hidden state (see
+ *                     agent.h)
+ *   MSG_RESIDUAL:     payload = client error-feedback residual (see codec.h)
  */
-static int recvInt(int source)
+struct MessageHeader
 {
-    int value;
-    if (MPI_Recv(&value, 1, MPI_INT, source, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE))
-      throw std::runtime_error("MPI_Recv failed");
-    return value;
-}
+  int32_t type;    // MSG_*
+  int32_t job;     // schedule (client) index, -1 if none
+  int32_t version; // global model version held (requests) or sent (replies)
+  int32_t arg[4];  // type-specific integer fields
+  int32_t model;   // MODEL_* (replies carrying the model)
+  uint64_t length; // payload bytes following the header
+};
 
 /**
- * Receive a byte array from an MPI process.
- * The first integer received is the length of the array.
+ * Builds a message header with no payload and zeroed fields.
  *
- * @param source The MPI process to receive from.
- * @return The byte array received.
+ * @param type The message type.
+ * @param job The schedule index, if any.
+ * @return The header.
  */
-static std::vector<char> recvBuffer(int source)
+static inline MessageHeader message_header(int type, int job = -1)
 {
-    int length = recvInt(source);
-    std::vector<char> bytes(length);
-    if (MPI_Recv(bytes.data(), length, MPI_BYTE, source, MPI_ANY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE))
-      throw std::runtime_error("MPI_Recv failed");
-    return bytes;
+  MessageHeader header = {};
+  header.type = type;
+  header.job = job;
+  header.version = -1;
+  return header;
 }
 
 /**
- * Send an integer to an MPI process.
- *
- * @param dest The MPI process to send to.
- * @param value The integer to send.
+ * A received message. The buffer holds the header followed by the payload
+ * and comes from the receiving layer's pool; hand it back with
+ * MessageLayer::recycle() once the payload has been consumed.
  */
-static void sendInt(int dest, int value)
+struct Message
 {
-    if (MPI_Send(&value, 1, MPI_INT, dest, 0, MPI_COMM_WORLD))
-      throw std::runtime_error("MPI_Send failed");
-}
+  int source = -1;
+  MessageHeader header = {};
+  std::vector<char> buffer;
+
+  const char* payload() const { return buffer.data() + sizeof(MessageHeader); }
+  size_t length() const { return header.length; }
+};
 
 /**
- * Send a byte array to an MPI process.
- * The first integer sent is the length of the array.
- *
- * @param dest The MPI process to send to.
- * @param bytes The byte array to send.
+ * Message layer over MPI point-to-point. Every exchange is a single MPI
+ * message carrying its own header; receives are sized with MPI_Probe and
+ * MPI_Get_count into pooled buffers, and sends are nonblocking and tracked
+ * until they complete.
  */
-static void sendBuffer(int dest, const std::vector<char>& bytes)
+class MessageLayer
 {
-    sendInt(dest, bytes.size());
-    if (MPI_Send(bytes.data(), bytes.size(), MPI_BYTE, dest, 0, MPI_COMM_WORLD))
-      throw std::runtime_error("MPI_Send failed");
-}
+public:
+    /**
+     * Constructs a message layer.
+     *
+     * @param comm The communicator to use.
+     */
+    MessageLayer(MPI_Comm comm = MPI_COMM_WORLD);
+
+    /**
+     * Waits for outstanding sends before tearing down.
+     */
+    ~MessageLayer();
+
+    /**
+     * Sends a message, copying the payload.
+     *
+     * @param dest The destination rank.
+     * @param header The header; length is the payload size.
+     * @param payload The payload, header.length bytes.
+     */
+    void send(int dest, const MessageHeader& header, const void* payload = nullptr);
+
+    /**
+     * Sends a message, taking ownership of the payload.
+     *
+     * @param dest The destination rank.
+     * @param header The header; length is set from the payload.
+     * @param payload The payload.
+     */
+    void send(int dest, MessageHeader header, std::vector<char>&& payload);
+
+    /**
+     * Sends a message whose payload is shared with other sends. The payload
+     * is kept alive, and not copied, until the send completes.
+     *
+     * @param dest The destination rank.
+     * @param header The header; length is set from the payload.
+     * @param payload The shared payload.
+     */
+    void send(int dest, MessageHeader header, std::shared_ptr<const std::vector<char>> payload);
+
+    /**
+     * Receives a message if one is available.
+     *
+     * @param msg The received message.
+     * @param source The rank to receive from.
+     * @param type The message type to receive.
+     * @return Whether a message was received.
+     */
+    bool poll(Message& msg, int source = MPI_ANY_SOURCE, int type = MPI_ANY_TAG);
+
+    /**
+     * Waits for and receives the next message.
+     *
+     * @param source The rank to receive from.
+     * @param type The message type to receive.
+     * @return The received message.
+     */
+    Message recv(int source = MPI_ANY_SOURCE, int type = MPI_ANY_TAG);
+
+    /**
+     * Returns a message buffer to the receive pool.
+     *
+     * @param msg The consumed message.
+     */
+    void recycle(Message& msg);
+
+    /**
+     * Retires completed sends.
+     */
+    void progress();
+
+    /**
+     * Waits for every outstanding send.
+     */
+    void flush();
+
+    /**
+     * Get the number of outstanding sends.
+     *
+     * @return The number of sends still in flight.
+     */
+    size_t in_flight() const { return sends.size(); }
+
+private:
+    /**
+     * An in-flight send and everything it references.
+     */
+    struct PendingSend
+    {
+      MPI_Request request;
+      MessageHeader header;
+      std::vector<char> owned;
+      std::shared_ptr<const std::vector<char>> shared;
+    };
+
+    /**
+     * Posts a send of the header followed by payload bytes.
+     */
+    void post(int dest, PendingSend& send, const void* payload);
+
+    /**
+     * Receives a probed message into a pooled buffer.
+     */
+    void receive(Message& msg, MPI_Status& status);
+
+    MPI_Comm comm;
+
+    // Outstanding sends (list: headers must not move while in flight)
+    std::list<PendingSend> sends;
+
+    // Receive buffers ready for reuse
+    std::vector<std::vector<char>> pool;
+};
+
+#endif
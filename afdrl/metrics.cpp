@@ -0,0 +1,124 @@
+/**
+ * @file metrics.cpp
+ * @brief Buffered CSV metrics written from a background thread
+ */
+
+#include "metrics.h"
+
+#include <cstdarg>
+#include <stdexcept>
+
+using namespace std;
+
+// Buffered bytes at which records are handed to the writer
+static const size_t FLUSH_BYTES = 1 << 16;
+
+MetricsSink::MetricsSink(const std::string& path, int param_every)
+  : param_every(param_every)
+{
+  file = fopen(path.c_str(), "w");
+
+  if (!file)
+    throw runtime_error("could not open metrics file " + path);
+
+  fputs("merge,F_time,client,steps,start_time,staleness,version,applied,bytes,norm,queue,held\n", file);
+  fputs("param,F_time,version,name,sum,norm\n", file);
+
+  buffer.reserve(FLUSH_BYTES * 2);
+
+  writer = thread(&MetricsSink::write_loop, this);
+}
+
+MetricsSink::~MetricsSink()
+{
+  flush();
+
+  {
+    lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+
+  ready.notify_one();
+  writer.join();
+
+  fclose(file);
+}
+
+void MetricsSink::append(const char* format, ...)
+{
+  char line[512];
+
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  if (n < 0)
+    return;
+
+  buffer.append(line, min(n, (int) sizeof(line) - 1));
+
+  if (buffer.size() >= FLUSH_BYTES)
+    flush();
+}
+
+void MetricsSink::merge(const MergeRecord& r, LSTMModel& model)
+{
+  append("merge,%d,%d,%d,%d,%d,%d,%d,%zu,%g,%zu,%zu\n",
+      r.F_time, r.client, r.steps, r.start_time, r.staleness, r.version,
+      (int) r.applied, r.bytes, r.norm, r.queue, r.held);
+
+  // Per-parameter statistics need a pass over the whole model; sample them.
+  if (!param_every || merges++ % param_every)
+    return;
+
+  torch::NoGradGuard no_grad;
+
+  for (auto& param : model.named_parameters())
+  {
+    torch::Tensor value = param.value().detach();
+
+    append("param,%d,%d,%s,%g,%g\n", r.F_time, r.version, param.key().c_str(),
+        value.sum().item<double>(), value.norm().item<double>());
+  }
+}
+
+void MetricsSink::flush()
+{
+  if (buffer.empty())
+    return;
+
+  {
+    lock_guard<std::mutex> lock(queue_mutex);
+    queue.push_back(std::move(buffer));
+  }
+
+  ready.notify_one();
+
+  buffer = string();
+  buffer.reserve(FLUSH_BYTES * 2);
+}
+
+void MetricsSink::write_loop()
+{
+  vector<string> batch;
+
+  while (1)
+  {
+    {
+      unique_lock<std::mutex> lock(queue_mutex);
+      ready.wait(lock, [this] { return stopping || !queue.empty(); });
+
+      batch.swap(queue);
+
+      if (batch.empty() && stopping)
+        break;
+    }
+
+    for (auto& chunk : batch)
+      fwrite(chunk.data(), 1, chunk.size(), file);
+
+    fflush(file);
+    batch.clear();
+  }
+}
@@ -0,0 +1,106 @@
+/**
+ * @file metrics.h
+ * @brief Buffered CSV metrics written from a background thread
+ */
+
+#ifndef AFDRL_METRICS_H
+#define AFDRL_METRICS_H
+
+#include "model.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * One merged client update.
+ */
+struct MergeRecord
+{
+  int F_time;       // federation time of the merge
+  int client;       // client index
+  int steps;        // environment steps of the job
+  int start_time;   // federation time the job started
+  int staleness;    // global versions since the job's model
+  int version;      // global model version after the merge
+  bool applied;     // whether the global model changed
+  size_t bytes;     // encoded update size
+  double norm;      // L2 norm of the decoded delta
+  size_t queue;     // scheduled events still queued
+  size_t held;      // bytes of early updates held by the scheduler
+};
+
+/**
+ * Writes metrics records as CSV lines. Records are formatted into a memory
+ * buffer on the calling thread; full buffers are handed to a background
+ * thread which does the file writes, so recording never waits on I/O.
+ *
+ * Every line starts with the record type:
+ *   merge,F_time,client,steps,start_time,staleness,version,applied,bytes,norm,queue,held
+ *   param,F_time,version,name,sum,norm
+ */
+class MetricsSink
+{
+public:
+    /**
+     * Opens the metrics file.
+     *
+     * @param path The output file.
+     * @param param_every Per-parameter statistics are written every this
+     *                    many merges (0 = never).
+     */
+    MetricsSink(const std::string& path, int param_every);
+
+    /**
+     * Writes everything recorded and closes the file.
+     */
+    ~MetricsSink();
+
+    MetricsSink(const MetricsSink&) = delete;
+    MetricsSink& operator=(const MetricsSink&) = delete;
+
+    /**
+     * Records a merged update, and the per-parameter statistics of the model
+     * when this merge is sampled.
+     *
+     * @param record The merge record.
+     * @param model The global model after the merge.
+     */
+    void merge(const MergeRecord& record, LSTMModel& model);
+
+    /**
+     * Hands the buffered records to the writer thread.
+     */
+    void flush();
+
+private:
+    /**
+     * Appends a formatted line to the buffer.
+     */
+    void append(const char* format, ...);
+
+    /**
+     * Writer thread body.
+     */
+    void write_loop();
+
+    FILE* file;
+    int param_every;
+    int merges = 0;
+
+    // Records being filled by the caller
+    std::string buffer;
+
+    // Records handed to the writer
+    std::mutex queue_mutex;
+    std::condition_variable ready;
+    std::vector<std::string> queue;
+    bool stopping = false;
+
+    std::thread writer;
+};
+
+#endif
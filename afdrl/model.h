@@ -3,13 +3,30 @@
 // remove me
 #include <iostream>
 
-#include <torch/serialize/input-archive.h>
-#include <torch/serialize/output-archive.h>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <tuple>
 
 #include "env.h"
+#include "preprocess.h"
 #include "torch_pch.h"
 
+// Model wire format identification ("AFDM").
+static const uint32_t MODEL_WIRE_MAGIC = 0x4d444641;
+static const uint16_t MODEL_WIRE_VERSION = 1;
+
+/**
+ * Header preceding the raw parameter bytes of a serialized model.
+ */
+struct ModelHeader {
+  uint32_t magic;   // MODEL_WIRE_MAGIC
+  uint16_t version; // MODEL_WIRE_VERSION
+  uint16_t dtype;   // c10::ScalarType of the payload
+  uint64_t schema;  // LSTMModel::schema_hash() of the sender
+  uint64_t bytes;   // payload size in bytes
+};
+
 class LSTMModel : public torch::nn::Module {
 public:
   LSTMModel(int channels, int n_actions, int stack=3) {
@@ -156,17 +173,186 @@ public:
    * @param tau The weight of the other model.
    */
   void add(const LSTMModel &other, float tau) {
-    for (auto &param : named_parameters()) {
-      torch::Tensor t;
-      torch::Tensor current = param.value().clone();
+    if (is_flat() && other.is_flat()) {
+      torch::NoGradGuard no_grad;
+      flat_params.add_(other.flat_params, tau);
+      return;
+    }
+
+    auto other_params = other.named_parameters();
 
+    for (auto &param : named_parameters()) {
       param.value().requires_grad_(false);
-      param.value() += other.named_parameters()[param.key()] * tau;
+      param.value() += other_params[param.key()] * tau;
       param.value().detach_();
       param.value().requires_grad_(true);
     }
   }
 
+  /**
+   * Copies parameters from another model with the same layout, on any
+   * device.
+   *
+   * @param other The model to copy from.
+   */
+  void copy_from(const LSTMModel &other) {
+    torch::NoGradGuard no_grad;
+
+    if (is_flat() && other.is_flat()) {
+      flat_params.copy_(other.flat_params);
+      return;
+    }
+
+    auto other_params = other.named_parameters();
+
+    for (auto &param : named_parameters())
+      param.value().copy_(other_params[param.key()]);
+  }
+
+  /**
+   * Backs every parameter and gradient with a single contiguous buffer.
+   * The module's parameter tensors become views into flat_params, and their
+   * gradients views into flat_grads, so whole-model operations run as one
+   * pass over one span. Parameter values are preserved.
+   *
+   * Gradients must then be cleared with clear_grad(), which zeroes them in
+   * place instead of dropping the views.
+   */
+  void flatten() {
+    torch::NoGradGuard no_grad;
+
+    auto params = parameters();
+
+    int64_t total = 0;
+    for (auto &param : params)
+      total += param.numel();
+
+    torch::Tensor data = torch::empty({total}, params[0].options());
+    torch::Tensor grad = torch::zeros({total}, params[0].options());
+
+    int64_t offset = 0;
+    for (auto &param : params) {
+      int64_t n = param.numel();
+
+      data.narrow(0, offset, n).copy_(param.reshape({-1}));
+      param.set_data(data.narrow(0, offset, n).view(param.sizes()));
+      param.mutable_grad() = grad.narrow(0, offset, n).view(param.sizes());
+
+      offset += n;
+    }
+
+    flat_params = data;
+    flat_params.requires_grad_(true);
+    flat_params.mutable_grad() = grad;
+    flat_grads = grad;
+  }
+
+  /**
+   * Returns the parameters as one flat tensor: a view of the flat buffer
+   * when flattened, otherwise a concatenated copy.
+   */
+  torch::Tensor flat_data() {
+    if (is_flat())
+      return flat_params.detach();
+
+    std::vector<torch::Tensor> views;
+    for (auto &param : parameters())
+      views.push_back(param.detach().reshape({-1}));
+
+    return torch::cat(views);
+  }
+
+  /**
+   * Element counts of each parameter tensor, in flat order.
+   */
+  std::vector<int64_t> segment_sizes() const {
+    std::vector<int64_t> sizes;
+    for (auto &param : parameters())
+      sizes.push_back(param.numel());
+    return sizes;
+  }
+
+  /**
+   * Adds a weighted flat delta (laid out like flat_data()).
+   *
+   * @param delta The flat delta.
+   * @param tau The weight of the delta.
+   */
+  void add_flat(const torch::Tensor &delta, float tau) {
+    torch::NoGradGuard no_grad;
+
+    if (is_flat()) {
+      flat_params.add_(delta, tau);
+      return;
+    }
+
+    int64_t offset = 0;
+    for (auto &param : parameters()) {
+      int64_t n = param.numel();
+      param.add_(delta.narrow(0, offset, n).view(param.sizes()), tau);
+      offset += n;
+    }
+  }
+
+  /**
+   * Whether the parameters are backed by a flat buffer.
+   */
+  bool is_flat() const { return flat_params.defined(); }
+
+  /**
+   * Moves the model, rebuilding the flat buffers on the new device.
+   */
+  using torch::nn::Module::to;
+  void to(torch::Device device, bool non_blocking = false) override {
+    torch::nn::Module::to(device, non_blocking);
+
+    // Moving replaces each parameter's data, detaching it from the buffer.
+    if (is_flat() && parameters()[0].data_ptr() != flat_params.data_ptr())
+      flatten();
+  }
+
+  /**
+   * Parameters an optimizer should update: the single flat buffer when
+   * flattened, otherwise every module parameter.
+   */
+  std::vector<torch::Tensor> optim_parameters() {
+    if (is_flat())
+      return {flat_params};
+
+    return parameters();
+  }
+
+  /**
+   * Zeroes the gradients in place.
+   */
+  void clear_grad() {
+    if (is_flat()) {
+      flat_grads.zero_();
+      return;
+    }
+
+    zero_grad();
+  }
+
+  /**
+   * Clips the gradient norm, as a single reduction when flattened.
+   *
+   * @param max_norm The maximum total gradient norm.
+   * @return The total norm before clipping.
+   */
+  double clip_grad_norm(double max_norm) {
+    if (!is_flat())
+      return torch::nn::utils::clip_grad_norm_(parameters(), max_norm);
+
+    double norm = flat_grads.norm().item<double>();
+    double coef = max_norm / (norm + 1e-6);
+
+    if (coef < 1.0)
+      flat_grads.mul_(coef);
+
+    return norm;
+  }
+
   /**
    * Add weighted parameters from another convolutional layer.
    *
@@ -210,101 +396,219 @@ public:
   }
 
   /**
-   * Serializes the model to a vector of bytes.
+   * Hashes the parameter layout (names and shapes, in order) so peers can
+   * reject buffers produced by a different model.
    *
-   * @return std::vector<char> The serialized model.
+   * @return uint64_t The FNV-1a hash of the layout.
    */
-  std::vector<char> serialize() {
-    std::vector<char> buffer;
-    std::stringstream stream;
+  uint64_t schema_hash() const {
+    uint64_t hash = 14695981039346656037ull;
 
-    torch::serialize::OutputArchive output_archive;
+    auto mix = [&hash](const void *data, size_t size) {
+      for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<const unsigned char *>(data)[i];
+        hash *= 1099511628211ull;
+      }
+    };
 
     for (auto &param : named_parameters()) {
-      output_archive.write(param.key(), param.value());
-      /*std::cout << "serialize param " << param.key() << " = "
-                << param.value().sum().item() << std::endl;*/
+      mix(param.key().data(), param.key().size());
+      for (int64_t dim : param.value().sizes())
+        mix(&dim, sizeof(dim));
     }
 
-    // Serialize the model to a string stream.
-    output_archive.save_to(stream);
-
-    // Convert the string stream to a vector of bytes.
-    buffer = std::vector<char>((std::istreambuf_iterator<char>(stream)),
-                               std::istreambuf_iterator<char>());
+    return hash;
+  }
 
-    return buffer;
+  /**
+   * Number of bytes taken by the raw parameter payload.
+   */
+  size_t payload_bytes() const {
+    size_t bytes = 0;
+    for (auto &param : parameters())
+      bytes += param.numel() * param.element_size();
+    return bytes;
   }
 
   /**
-   * Deserializes the model from a vector of bytes.
+   * Serializes the model into a reusable buffer: a ModelHeader followed by
+   * the raw parameter bytes, copied straight from parameter memory.
    *
-   * @param buffer The serialized model.
+   * @param buffer The output buffer, resized as needed.
    */
-  void deserialize(std::vector<char> buffer) {
-    // std::cout << "Deserializing model..." << std::endl;
-    // std::cout << "Buffer size: " << buffer.size() << std::endl;
-
-    std::stringstream stream;
+  void serialize_into(std::vector<char> &buffer) {
+    size_t bytes = payload_bytes();
+    buffer.resize(sizeof(ModelHeader) + bytes);
+
+    ModelHeader header;
+    header.magic = MODEL_WIRE_MAGIC;
+    header.version = MODEL_WIRE_VERSION;
+    header.dtype = static_cast<uint16_t>(parameters()[0].scalar_type());
+    header.schema = schema_hash();
+    header.bytes = bytes;
+    memcpy(buffer.data(), &header, sizeof(header));
+
+    char *out = buffer.data() + sizeof(header);
+
+    if (is_flat()) {
+      write_tensor(flat_params, out);
+      return;
+    }
 
-    // Convert the vector of bytes to a string stream.
-    stream = std::stringstream(std::string(buffer.begin(), buffer.end()));
+    for (auto &param : parameters()) {
+      write_tensor(param, out);
+      out += param.numel() * param.element_size();
+    }
+  }
 
-    torch::serialize::InputArchive stored_params;
-    stored_params.load_from(stream);
+  /**
+   * Serializes the model to a vector of bytes.
+   *
+   * @return std::vector<char> The serialized model.
+   */
+  std::vector<char> serialize() {
+    std::vector<char> buffer;
+    serialize_into(buffer);
+    return buffer;
+  }
 
-    for (auto &param : named_parameters()) {
-      torch::Tensor t;
-      torch::Tensor current = param.value().clone();
-
-      if (stored_params.try_read(param.key(), t)) {
-        // param.value().requires_grad_(false);
-        // param.value().copy_(t);
-        // param.value().requires_grad_(true);
-        // param.value() = t;
-        // named_parameters()[param.key()] = t;
-        // register_parameter(param.key(), t);
-        param.value().requires_grad_(false);
-        param.value() *= 0;
-        param.value() += t;
-        param.value().detach_();
-        param.value().requires_grad_(true);
-      } else {
-        throw std::runtime_error("Could not find param: " + param.key());
-      }
+  /**
+   * Deserializes the model, copying the payload straight into parameter
+   * memory.
+   *
+   * @param data The serialized model.
+   * @param size The size of the serialized model in bytes.
+   */
+  void deserialize(const char *data, size_t size) {
+    if (size < sizeof(ModelHeader))
+      throw std::runtime_error("model buffer too small");
+
+    ModelHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    if (header.magic != MODEL_WIRE_MAGIC || header.version != MODEL_WIRE_VERSION)
+      throw std::runtime_error("unknown model wire format");
+    if (header.dtype != static_cast<uint16_t>(parameters()[0].scalar_type()))
+      throw std::runtime_error("model dtype mismatch");
+    if (header.schema != schema_hash())
+      throw std::runtime_error("model layout mismatch");
+    if (header.bytes != payload_bytes() || size != sizeof(header) + header.bytes)
+      throw std::runtime_error("model payload size mismatch");
+
+    const char *in = data + sizeof(header);
+
+    if (is_flat()) {
+      read_tensor(flat_params, in);
+      return;
+    }
 
-      /*std::cout << "deserialize param " << param.key() << " current "
-                << current.sum().item() << " stored " << t.sum().item()
-                << " new " << param.value().sum().item() << " new named "
-                << named_parameters()[param.key()].sum().item() << std::endl;*/
+    for (auto &param : parameters()) {
+      read_tensor(param, in);
+      in += param.numel() * param.element_size();
     }
   }
 
   /**
-   * Forward pass of the model.
+   * Deserializes the model from a vector of bytes.
    *
-   * @param iv The input tensor.
-   * @return torch::IValue The output tensor.
+   * @param buffer The serialized model.
    */
-  torch::IValue forward(torch::IValue iv) {
-    auto lst = iv.toTensorList();
-    torch::Tensor inputs = lst[0], hx = lst[1], cx = lst[2];
+  void deserialize(const std::vector<char> &buffer) {
+    deserialize(buffer.data(), buffer.size());
+  }
+
+  /**
+   * Converts stacked bit-packed frames into model input (0 or 1 per pixel).
+   * This is the only place observations are widened to float.
+   *
+   * @param frames Packed frames shaped [..., C, OBS_PACKED].
+   * @return torch::Tensor The float input tensor, [..., C, 80, 80].
+   */
+  static torch::Tensor input(const torch::Tensor& frames) {
+    std::vector<int64_t> sizes = frames.sizes().vec();
+    sizes.back() = OBS_SIZE;
+    sizes.push_back(OBS_SIZE);
+
+    if (frames.device().is_cpu())
+    {
+      torch::Tensor packed = frames.contiguous();
+      torch::Tensor out = torch::empty(sizes, torch::kFloat);
+      unpack_obs(packed.data_ptr<uint8_t>(), out.data_ptr<float>(), packed.numel());
+      return out;
+    }
 
-    //std::cout << "shape " << inputs.sizes() << std::endl;
+    // Elsewhere, test each bit with tensor ops on the device
+    torch::Tensor bits = torch::tensor({1, 2, 4, 8, 16, 32, 64, 128}, torch::dtype(torch::kUInt8)).to(frames.device());
+    return frames.unsqueeze(-1).bitwise_and(bits).ne(0).to(torch::kFloat).view(sizes);
+  }
 
+  /**
+   * Convolutional trunk of the model. It has no recurrence, so the frames
+   * of a whole rollout can go through in one call.
+   *
+   * In train mode, BatchNorm normalizes with batch statistics, so a frame's
+   * features depend on the batch it came with. Splitting the batch into
+   * groups gives each group its own statistics, exactly as if it went
+   * through alone: a rollout of T steps over N environments, passed as T
+   * groups, matches the T batch-N forwards that acted on it.
+   *
+   * @param inputs Float input shaped [B, C, 80, 80].
+   * @param groups Number of equal, consecutive groups of the batch.
+   * @return torch::Tensor The features, [B, 1024].
+   */
+  torch::Tensor features(torch::Tensor inputs, int64_t groups = 1) {
     // Pass the input through each convolutional layer, followed by a max
     // pooling layer.
-    inputs = torch::relu(bn1(conv1->forward(inputs)));
+    inputs = torch::relu(batch_norm(bn1, conv1->forward(inputs), groups));
     inputs = maxp1->forward(inputs);
-    inputs = torch::relu(bn2(conv2->forward(inputs)));
+    inputs = torch::relu(batch_norm(bn2, conv2->forward(inputs), groups));
     inputs = maxp2->forward(inputs);
-    inputs = torch::relu(bn3(conv3->forward(inputs)));
+    inputs = torch::relu(batch_norm(bn3, conv3->forward(inputs), groups));
     inputs = maxp3->forward(inputs);
     inputs = torch::relu(conv4->forward(inputs));
     inputs = maxp4->forward(inputs);
 
     // Reshape the input to be 1 x 1 x 1024 (required by LSTM).
-    inputs = inputs.view({inputs.size(0), -1});
+    return inputs.view({inputs.size(0), -1});
+  }
+
+  /**
+   * Applies a BatchNorm layer, with separate batch statistics for each
+   * group in train mode. Grouped batches leave the running statistics
+   * alone: the forwards that acted on the same frames already counted them.
+   *
+   * @param bn The layer.
+   * @param x Input shaped [B, C, H, W].
+   * @param groups Number of equal, consecutive groups of the batch.
+   * @return torch::Tensor The normalized input.
+   */
+  torch::Tensor batch_norm(torch::nn::BatchNorm2d& bn, const torch::Tensor& x, int64_t groups) {
+    if (groups <= 1 || !is_training())
+      return bn(x);
+
+    torch::Tensor g = x.view({groups, -1, x.size(1), x.size(2), x.size(3)});
+
+    // Biased variance, as BatchNorm normalizes with in train mode
+    torch::Tensor mean = g.mean({1, 3, 4}, true);
+    torch::Tensor var = g.var({1, 3, 4}, false, true);
+
+    g = (g - mean) * torch::rsqrt(var + bn->options.eps());
+    g = g * bn->weight.view({1, 1, -1, 1, 1}) + bn->bias.view({1, 1, -1, 1, 1});
+
+    return g.view(x.sizes());
+  }
+
+  /**
+   * Forward pass of the model.
+   *
+   * @param iv The input tensor.
+   * @return torch::IValue The output tensor.
+   */
+  torch::IValue forward(torch::IValue iv) {
+    auto lst = iv.toTensorList();
+    torch::Tensor inputs = lst[0], hx = lst[1], cx = lst[2];
+
+    inputs = features(inputs);
 
     // Pass the input through the LSTM layer.
     auto lstm_out = lstm->forward(inputs, std::make_tuple(hx, cx));
@@ -331,6 +635,32 @@ public:
                        maxp4 = nullptr; // 2, 2, 2, 2
   torch::nn::LSTMCell lstm = nullptr;   // 1024, 512
   torch::nn::BatchNorm2d bn1 = nullptr, bn2 = nullptr, bn3 = nullptr, bn4 = nullptr;
-
   int n_actions; // The number of actions the agent can take.
+
+  // Flat parameter and gradient buffers (undefined unless flatten() was called).
+  torch::Tensor flat_params, flat_grads;
+
+private:
+  /**
+   * Copies a contiguous tensor's bytes out, staging through the CPU if needed.
+   */
+  static void write_tensor(const torch::Tensor &t, char *out) {
+    torch::Tensor src = t.device().is_cpu() ? t : t.detach().to(torch::kCPU);
+    memcpy(out, src.data_ptr(), src.numel() * src.element_size());
+  }
+
+  /**
+   * Copies raw bytes into a contiguous tensor, staging through the CPU if
+   * needed.
+   */
+  static void read_tensor(torch::Tensor &t, const char *in) {
+    if (t.device().is_cpu()) {
+      memcpy(t.data_ptr(), in, t.numel() * t.element_size());
+      return;
+    }
+
+    torch::NoGradGuard no_grad;
+    t.copy_(torch::from_blob(const_cast<char *>(in), t.sizes(),
+                             t.options().device(torch::kCPU)));
+  }
 };
@@ -0,0 +1,269 @@
+/**
+ * @file optim.cpp
+ * @brief Persistent worker optimizer with transferable state
+ */
+
+#include "optim.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+using namespace std;
+
+// Key type of the optimizer state map, which differs between libtorch
+// releases (stringified or raw TensorImpl pointer).
+typedef std::decay_t<decltype(std::declval<torch::optim::Optimizer&>().state())>::key_type StateKey;
+
+[[maybe_unused]] static std::string state_key(const torch::Tensor& param, std::string*)
+{
+  return c10::guts::to_string(param.unsafeGetTensorImpl());
+}
+
+[[maybe_unused]] static void* state_key(const torch::Tensor& param, void**)
+{
+  return param.unsafeGetTensorImpl();
+}
+
+/**
+ * Gets the key an optimizer files a parameter's state under.
+ */
+static StateKey key_of(const torch::Tensor& param)
+{
+  return state_key(param, (StateKey*) nullptr);
+}
+
+OptimStatePolicy parse_optim_state(const std::string& name)
+{
+  if (name == "reset")
+    return OPTIM_STATE_RESET;
+  if (name == "worker")
+    return OPTIM_STATE_WORKER;
+  if (name == "client")
+    return OPTIM_STATE_CLIENT;
+
+  throw runtime_error("unknown optimizer state policy: " + name);
+}
+
+WorkerOptimizer::WorkerOptimizer(const std::string& name, float lr)
+  : name(name), lr(lr)
+{
+  if (name != "sgd" && name != "adam" && name != "rmsprop")
+    throw runtime_error("unknown optimizer");
+}
+
+torch::optim::Optimizer& WorkerOptimizer::bind(LSTMModel& model)
+{
+  std::vector<torch::Tensor> params = model.optim_parameters();
+
+  if (!optimizer)
+  {
+    if (name == "sgd")
+      optimizer.reset(new torch::optim::SGD(params, torch::optim::SGDOptions(lr)));
+    else if (name == "adam")
+      optimizer.reset(new torch::optim::Adam(params, torch::optim::AdamOptions(lr)));
+    else
+      optimizer.reset(new torch::optim::RMSprop(params, torch::optim::RMSpropOptions(lr)));
+
+    allocate_state();
+    return *optimizer;
+  }
+
+  std::vector<torch::Tensor>& bound = optimizer->param_groups()[0].params();
+
+  if (bound.size() != params.size())
+    throw runtime_error("optimizer rebound to a different parameter layout");
+
+  auto& state = optimizer->state();
+
+  for (size_t i = 0; i < params.size(); i++)
+  {
+    if (bound[i].unsafeGetTensorImpl() == params[i].unsafeGetTensorImpl())
+      continue;
+
+    // The parameter tensor was replaced (e.g. the model was re-flattened):
+    // move its state over instead of letting the optimizer start fresh.
+    auto it = state.find(key_of(bound[i]));
+
+    if (it != state.end())
+    {
+      auto param_state = std::move(it->second);
+      state.erase(it);
+      state[key_of(params[i])] = std::move(param_state);
+    }
+
+    bound[i] = params[i];
+  }
+
+  // State follows its parameters across devices.
+  std::vector<torch::Tensor*> tensors;
+  std::vector<int64_t*> steps;
+  collect(tensors, steps);
+
+  torch::Device device = params[0].device();
+  for (auto* t : tensors)
+    if (t->device() != device)
+      *t = t->to(device);
+
+  return *optimizer;
+}
+
+void WorkerOptimizer::allocate_state()
+{
+  torch::NoGradGuard no_grad;
+
+  auto& state = optimizer->state();
+
+  for (auto& p : optimizer->param_groups()[0].params())
+  {
+    if (name == "adam")
+    {
+      auto param_state = std::make_unique<torch::optim::AdamParamState>();
+      param_state->step(0);
+      param_state->exp_avg(torch::zeros_like(p, torch::MemoryFormat::Preserve));
+      param_state->exp_avg_sq(torch::zeros_like(p, torch::MemoryFormat::Preserve));
+      state[key_of(p)] = std::move(param_state);
+    } else if (name == "rmsprop") {
+      auto param_state = std::make_unique<torch::optim::RMSpropParamState>();
+      param_state->step(0);
+      param_state->square_avg(torch::zeros_like(p, torch::MemoryFormat::Preserve));
+      state[key_of(p)] = std::move(param_state);
+    }
+
+    // SGD without momentum keeps no state.
+  }
+}
+
+void WorkerOptimizer::collect(std::vector<torch::Tensor*>& tensors, std::vector<int64_t*>& steps)
+{
+  auto& state = optimizer->state();
+
+  for (auto& p : optimizer->param_groups()[0].params())
+  {
+    auto it = state.find(key_of(p));
+    if (it == state.end())
+      continue;
+
+    torch::optim::OptimizerParamState* base = it->second.get();
+
+    if (auto* s = dynamic_cast<torch::optim::AdamParamState*>(base))
+    {
+      steps.push_back(&s->step());
+      tensors.push_back(&s->exp_avg());
+      tensors.push_back(&s->exp_avg_sq());
+      if (s->max_exp_avg_sq().defined())
+        tensors.push_back(&s->max_exp_avg_sq());
+    } else if (auto* s = dynamic_cast<torch::optim::RMSpropParamState*>(base)) {
+      steps.push_back(&s->step());
+      tensors.push_back(&s->square_avg());
+      if (s->momentum_buffer().defined())
+        tensors.push_back(&s->momentum_buffer());
+      if (s->grad_avg().defined())
+        tensors.push_back(&s->grad_avg());
+    } else if (auto* s = dynamic_cast<torch::optim::SGDParamState*>(base)) {
+      if (s->momentum_buffer().defined())
+        tensors.push_back(&s->momentum_buffer());
+    }
+  }
+}
+
+void WorkerOptimizer::reset()
+{
+  torch::NoGradGuard no_grad;
+
+  std::vector<torch::Tensor*> tensors;
+  std::vector<int64_t*> steps;
+  collect(tensors, steps);
+
+  for (auto* t : tensors)
+    t->zero_();
+
+  for (auto* step : steps)
+    *step = 0;
+}
+
+std::vector<char> WorkerOptimizer::export_state(uint64_t schema)
+{
+  torch::NoGradGuard no_grad;
+
+  std::vector<torch::Tensor*> tensors;
+  std::vector<int64_t*> steps;
+  collect(tensors, steps);
+
+  if (tensors.empty())
+    return {};
+
+  size_t bytes = sizeof(OptimStateHeader);
+  for (auto* t : tensors)
+    bytes += sizeof(int64_t) + t->numel() * sizeof(at::BFloat16);
+
+  std::vector<char> buffer(bytes);
+
+  OptimStateHeader header;
+  header.magic = OPTIM_WIRE_MAGIC;
+  header.tensors = tensors.size();
+  header.schema = schema;
+  header.step = steps.empty() ? 0 : *steps[0];
+  memcpy(buffer.data(), &header, sizeof(header));
+
+  char* out = buffer.data() + sizeof(header);
+
+  for (auto* t : tensors)
+  {
+    int64_t numel = t->numel();
+    memcpy(out, &numel, sizeof(numel));
+    out += sizeof(numel);
+
+    torch::Tensor half = t->to(torch::kCPU, torch::kBFloat16).contiguous();
+    memcpy(out, half.data_ptr(), numel * sizeof(at::BFloat16));
+    out += numel * sizeof(at::BFloat16);
+  }
+
+  return buffer;
+}
+
+void WorkerOptimizer::import_state(const char* data, size_t size, uint64_t schema)
+{
+  torch::NoGradGuard no_grad;
+
+  if (size < sizeof(OptimStateHeader))
+    throw runtime_error("optimizer state too small");
+
+  OptimStateHeader header;
+  memcpy(&header, data, sizeof(header));
+
+  if (header.magic != OPTIM_WIRE_MAGIC)
+    throw runtime_error("unknown optimizer state format");
+  if (header.schema != schema)
+    throw runtime_error("optimizer state layout mismatch");
+
+  std::vector<torch::Tensor*> tensors;
+  std::vector<int64_t*> steps;
+  collect(tensors, steps);
+
+  if (header.tensors != tensors.size())
+    throw runtime_error("optimizer state does not match the optimizer");
+
+  const char* in = data + sizeof(header);
+  const char* end = data + size;
+
+  for (auto* t : tensors)
+  {
+    int64_t numel;
+
+    if (in + sizeof(numel) > end)
+      throw runtime_error("optimizer state truncated");
+
+    memcpy(&numel, in, sizeof(numel));
+    in += sizeof(numel);
+
+    if (numel != t->numel() || in + numel * sizeof(at::BFloat16) > end)
+      throw runtime_error("optimizer state size mismatch");
+
+    t->copy_(torch::from_blob(const_cast<char*>(in), t->sizes(), torch::kBFloat16));
+    in += numel * sizeof(at::BFloat16);
+  }
+
+  for (auto* step : steps)
+    *step = header.step;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file optim.h
+ * @brief Persistent worker optimizer with transferable state
+ */
+
+#ifndef AFDRL_OPTIM_H
+#define AFDRL_OPTIM_H
+
+#include "torch_pch.h"
+#include "model.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * What happens to optimizer state between jobs.
+ */
+enum OptimStatePolicy
+{
+  OPTIM_STATE_RESET,  // zeroed at the start of every job
+  OPTIM_STATE_WORKER, // carried across every job the worker runs
+  OPTIM_STATE_CLIENT, // kept per client by the scheduler and shipped with jobs
+};
+
+// Optimizer state wire format identification ("AFDO").
+static const uint32_t OPTIM_WIRE_MAGIC = 0x4f444641;
+
+/**
+ * Header preceding exported optimizer state, followed for every state
+ * tensor by int64 numel and bfloat16[numel]. bfloat16 keeps the float32
+ * exponent range, so small second moments do not flush to zero as they
+ * would in fp16.
+ */
+struct OptimStateHeader
+{
+  uint32_t magic;   // OPTIM_WIRE_MAGIC
+  uint32_t tensors; // number of state tensors
+  uint64_t schema;  // LSTMModel::schema_hash() of the sender
+  int64_t step;     // optimizer step count
+};
+
+/**
+ * Parses an optimizer state policy name.
+ *
+ * @param name The policy name (reset, worker, client).
+ * @return The policy.
+ */
+OptimStatePolicy parse_optim_state(const std::string& name);
+
+/**
+ * An optimizer that lives as long as the worker. Its state is allocated
+ * once, when it is first bound to a model, and afterwards only rebound,
+ * zeroed or overwritten in place.
+ */
+class WorkerOptimizer
+{
+public:
+    /**
+     * Constructs an unbound optimizer.
+     *
+     * @param name The optimizer name (sgd, adam, rmsprop).
+     * @param lr The learning rate.
+     */
+    WorkerOptimizer(const std::string& name, float lr);
+
+    /**
+     * Binds the optimizer to a model's parameters. Creates the optimizer on
+     * first use; afterwards, if the parameter tensors changed, existing state
+     * moves over to the new tensors.
+     *
+     * @param model The model to optimize.
+     * @return The bound optimizer.
+     */
+    torch::optim::Optimizer& bind(LSTMModel& model);
+
+    /**
+     * Zeroes all state in place, equivalent to a fresh optimizer.
+     */
+    void reset();
+
+    /**
+     * Exports the state, compressed to bfloat16.
+     *
+     * @param schema The model schema hash.
+     * @return The encoded state, empty if the optimizer keeps no state.
+     */
+    std::vector<char> export_state(uint64_t schema);
+
+    /**
+     * Loads previously exported state.
+     *
+     * @param data The encoded state.
+     * @param size The encoded state size in bytes.
+     * @param schema The expected model schema hash.
+     */
+    void import_state(const char* data, size_t size, uint64_t schema);
+
+private:
+    /**
+     * Creates zeroed state for every bound parameter.
+     */
+    void allocate_state();
+
+    /**
+     * Collects the state tensors and step counters in a fixed order.
+     */
+    void collect(std::vector<torch::Tensor*>& tensors, std::vector<int64_t*>& steps);
+
+    std::string name;
+    float lr;
+
+    std::unique_ptr<torch::optim::Optimizer> optimizer;
+};
+
+#endif
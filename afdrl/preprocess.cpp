@@ -0,0 +1,374 @@
+/**
+ * @file preprocess.cpp
+ * @brief Fused observation preprocessing kernels
+ */
+
+#include "preprocess.h"
+
+#include <cstring>
+
+// AVX2 kernels are compiled for their own target and picked at run time, so
+// a generic build still uses them and never runs them on a CPU without AVX2.
+// NEON is part of the aarch64 baseline.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PREPROCESS_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define PREPROCESS_NEON
+#include <arm_neon.h>
+#endif
+
+// Fixed-point BT.601 luma weights, matching OpenCV 4 RGB2Gray<uchar>.
+static const int GRAY_SHIFT = 15;
+static const int GRAY_R = 9798;
+static const int GRAY_G = 19235;
+static const int GRAY_B = 3735;
+
+// Binary threshold applied after downsampling (cv::threshold semantics: > THRESHOLD).
+static const int THRESHOLD = 128;
+
+static_assert(OBS_SIZE % 8 == 0, "vector kernels emit 8 output pixels at a time");
+static_assert(OBS_SIZE * OBS_SIZE % 32 == 0, "pack_obs() packs 32 pixels at a time");
+
+/**
+ * Checks whether the CPU runs the vector kernels.
+ */
+static bool simd_supported()
+{
+#if defined(PREPROCESS_AVX2)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#elif defined(PREPROCESS_NEON)
+  return true;
+#else
+  return false;
+#endif
+}
+
+static bool use_simd = simd_supported();
+
+bool preprocess_use_simd(bool enable)
+{
+  use_simd = enable && simd_supported();
+  return use_simd;
+}
+
+bool preprocess_fused_supported(int crop_width, int crop_height)
+{
+  return crop_width == 2 * OBS_SIZE && crop_height == 2 * OBS_SIZE;
+}
+
+/**
+ * Converts a single RGB pixel to gray.
+ */
+static inline int gray_scalar(const uint8_t* px)
+{
+  return (px[0] * GRAY_R + px[1] * GRAY_G + px[2] * GRAY_B + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT;
+}
+
+/**
+ * Produces one packed output row from two source rows.
+ */
+static void row_scalar(const uint8_t* row0, const uint8_t* row1, uint8_t* dst)
+{
+  for (int x = 0; x < OBS_SIZE; x += 8)
+  {
+    uint8_t bits = 0;
+
+    for (int k = 0; k < 8; k++)
+    {
+      const uint8_t* a = row0 + (x + k) * 6;
+      const uint8_t* b = row1 + (x + k) * 6;
+
+      int sum = gray_scalar(a) + gray_scalar(a + 3) + gray_scalar(b) + gray_scalar(b + 3);
+
+      if (((sum + 2) >> 2) > THRESHOLD)
+        bits |= 1 << k;
+    }
+
+    dst[x / 8] = bits;
+  }
+}
+
+#if defined(PREPROCESS_AVX2)
+
+/**
+ * Converts 16 packed RGB pixels to 16-bit gray values. Each 128-bit lane
+ * handles a group of 8 pixels: lane 0 holds pixels 0-7, lane 1 pixels 8-15.
+ */
+AVX2_TARGET static inline __m256i gray16_avx2(const uint8_t* src)
+{
+  // Per group, lo holds bytes [0, 16) and hi holds bytes [8, 24).
+  __m256i lo = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) src)),
+      _mm_loadu_si128((const __m128i*) (src + 24)), 1);
+  __m256i hi = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (src + 8))),
+      _mm_loadu_si128((const __m128i*) (src + 32)), 1);
+
+  // Gather zero-extended (R, G) pairs and B for pixels 0-3 from lo and
+  // pixels 4-7 from hi.
+  const __m256i rg_lo = _mm256_setr_epi8(
+      0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1,
+      0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+  const __m256i b_lo = _mm256_setr_epi8(
+      2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+      2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+  const __m256i rg_hi = _mm256_setr_epi8(
+      4, -1, 5, -1, 7, -1, 8, -1, 10, -1, 11, -1, 13, -1, 14, -1,
+      4, -1, 5, -1, 7, -1, 8, -1, 10, -1, 11, -1, 13, -1, 14, -1);
+  const __m256i b_hi = _mm256_setr_epi8(
+      6, -1, -1, -1, 9, -1, -1, -1, 12, -1, -1, -1, 15, -1, -1, -1,
+      6, -1, -1, -1, 9, -1, -1, -1, 12, -1, -1, -1, 15, -1, -1, -1);
+
+  const __m256i c_rg = _mm256_set1_epi32((GRAY_G << 16) | GRAY_R);
+  const __m256i c_b = _mm256_set1_epi32(GRAY_B);
+  const __m256i round = _mm256_set1_epi32(1 << (GRAY_SHIFT - 1));
+
+  __m256i g0 = _mm256_add_epi32(
+      _mm256_madd_epi16(_mm256_shuffle_epi8(lo, rg_lo), c_rg),
+      _mm256_madd_epi16(_mm256_shuffle_epi8(lo, b_lo), c_b));
+  __m256i g1 = _mm256_add_epi32(
+      _mm256_madd_epi16(_mm256_shuffle_epi8(hi, rg_hi), c_rg),
+      _mm256_madd_epi16(_mm256_shuffle_epi8(hi, b_hi), c_b));
+
+  g0 = _mm256_srli_epi32(_mm256_add_epi32(g0, round), GRAY_SHIFT);
+  g1 = _mm256_srli_epi32(_mm256_add_epi32(g1, round), GRAY_SHIFT);
+
+  // Lane-wise pack keeps pixel order within each group.
+  return _mm256_packs_epi32(g0, g1);
+}
+
+/**
+ * Produces one packed output row from two source rows, 8 outputs (one
+ * byte) per iteration.
+ */
+AVX2_TARGET static void row_avx2(const uint8_t* row0, const uint8_t* row1, uint8_t* dst)
+{
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i bias = _mm256_set1_epi32(2);
+  const __m256i thresh = _mm256_set1_epi32(THRESHOLD);
+
+  for (int x = 0; x < OBS_SIZE; x += 8)
+  {
+    __m256i sum = _mm256_add_epi16(gray16_avx2(row0 + x * 6), gray16_avx2(row1 + x * 6));
+
+    // Adjacent pairs complete the 2x2 boxes: outputs x..x+3 land in lane 0
+    // and x+4..x+7 in lane 1.
+    __m256i box = _mm256_madd_epi16(sum, ones);
+    __m256i avg = _mm256_srli_epi32(_mm256_add_epi32(box, bias), 2);
+
+    // The sign mask is already the packed byte
+    dst[x / 8] = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(avg, thresh)));
+  }
+}
+
+/**
+ * Bit-packs 32 pixels at a time: the byte sign bits are the pixels.
+ */
+AVX2_TARGET static void pack_avx2(const uint8_t* frame, uint8_t* out)
+{
+  for (int i = 0; i < OBS_SIZE * OBS_SIZE; i += 32)
+  {
+    uint32_t bits = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) (frame + i)));
+    memcpy(out + i / 8, &bits, sizeof(bits));
+  }
+}
+
+/**
+ * Expands one packed byte per iteration by broadcasting it and testing one
+ * bit per lane.
+ */
+AVX2_TARGET static void unpack_avx2(const uint8_t* packed, float* out, size_t bytes)
+{
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 one = _mm256_set1_ps(1.0f);
+
+  for (size_t i = 0; i < bytes; i++)
+  {
+    __m256i v = _mm256_and_si256(_mm256_set1_epi32(packed[i]), bits);
+    __m256 set = _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, bits));
+
+    _mm256_storeu_ps(out + i * 8, _mm256_and_ps(set, one));
+  }
+}
+
+#elif defined(PREPROCESS_NEON)
+
+/**
+ * Converts 8 deinterleaved RGB pixels to 16-bit gray values.
+ */
+static inline uint16x8_t gray8_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+  uint16x8_t r16 = vmovl_u8(r), g16 = vmovl_u8(g), b16 = vmovl_u8(b);
+
+  uint32x4_t lo = vmull_n_u16(vget_low_u16(r16), GRAY_R);
+  lo = vmlal_n_u16(lo, vget_low_u16(g16), GRAY_G);
+  lo = vmlal_n_u16(lo, vget_low_u16(b16), GRAY_B);
+
+  uint32x4_t hi = vmull_n_u16(vget_high_u16(r16), GRAY_R);
+  hi = vmlal_n_u16(hi, vget_high_u16(g16), GRAY_G);
+  hi = vmlal_n_u16(hi, vget_high_u16(b16), GRAY_B);
+
+  return vcombine_u16(vrshrn_n_u32(lo, GRAY_SHIFT), vrshrn_n_u32(hi, GRAY_SHIFT));
+}
+
+// Weights of the 8 pixels of a packed byte.
+static const uint8_t BIT_WEIGHTS[8] = {1, 2, 4, 8, 16, 32, 64, 128};
+
+/**
+ * Produces one packed output row from two source rows, 8 outputs (one
+ * byte) per iteration.
+ */
+static void row_neon(const uint8_t* row0, const uint8_t* row1, uint8_t* dst)
+{
+  const uint16x8_t thresh = vdupq_n_u16(THRESHOLD);
+  const uint8x8_t weights = vld1_u8(BIT_WEIGHTS);
+
+  for (int x = 0; x < OBS_SIZE; x += 8)
+  {
+    uint8x16x3_t a = vld3q_u8(row0 + x * 6);
+    uint8x16x3_t b = vld3q_u8(row1 + x * 6);
+
+    uint16x8_t lo = vaddq_u16(
+        gray8_neon(vget_low_u8(a.val[0]), vget_low_u8(a.val[1]), vget_low_u8(a.val[2])),
+        gray8_neon(vget_low_u8(b.val[0]), vget_low_u8(b.val[1]), vget_low_u8(b.val[2])));
+    uint16x8_t hi = vaddq_u16(
+        gray8_neon(vget_high_u8(a.val[0]), vget_high_u8(a.val[1]), vget_high_u8(a.val[2])),
+        gray8_neon(vget_high_u8(b.val[0]), vget_high_u8(b.val[1]), vget_high_u8(b.val[2])));
+
+    // Pairwise adds complete the 2x2 boxes; rounding shift divides by 4.
+    uint16x8_t avg = vrshrq_n_u16(vpaddq_u16(lo, hi), 2);
+
+    uint8x8_t mask = vmovn_u16(vcgtq_u16(avg, thresh));
+    dst[x / 8] = vaddv_u8(vand_u8(mask, weights));
+  }
+}
+
+/**
+ * Bit-packs 8 pixels at a time by weighting and summing them.
+ */
+static void pack_neon(const uint8_t* frame, uint8_t* out)
+{
+  const uint8x8_t weights = vld1_u8(BIT_WEIGHTS);
+
+  for (int i = 0; i < OBS_SIZE * OBS_SIZE; i += 8)
+    out[i / 8] = vaddv_u8(vand_u8(vld1_u8(frame + i), weights));
+}
+
+/**
+ * Expands one packed byte per iteration, 4 bits per test.
+ */
+static void unpack_neon(const uint8_t* packed, float* out, size_t bytes)
+{
+  const uint32_t lo_bits[4] = {1, 2, 4, 8};
+  const uint32_t hi_bits[4] = {16, 32, 64, 128};
+  const uint32x4_t lo = vld1q_u32(lo_bits);
+  const uint32x4_t hi = vld1q_u32(hi_bits);
+  const uint32x4_t one = vreinterpretq_u32_f32(vdupq_n_f32(1.0f));
+
+  for (size_t i = 0; i < bytes; i++)
+  {
+    uint32x4_t v = vdupq_n_u32(packed[i]);
+
+    vst1q_f32(out + i * 8, vreinterpretq_f32_u32(vandq_u32(vtstq_u32(v, lo), one)));
+    vst1q_f32(out + i * 8 + 4, vreinterpretq_f32_u32(vandq_u32(vtstq_u32(v, hi), one)));
+  }
+}
+
+#endif
+
+void preprocess_rgb_fused(const uint8_t* rgb, int screen_width, int crop_x, int crop_y, uint8_t* out)
+{
+  const int stride = screen_width * 3;
+
+  for (int y = 0; y < OBS_SIZE; y++)
+  {
+    const uint8_t* row0 = rgb + (crop_y + 2 * y) * stride + crop_x * 3;
+    const uint8_t* row1 = row0 + stride;
+    uint8_t* dst = out + y * (OBS_SIZE / 8);
+
+#if defined(PREPROCESS_AVX2)
+    if (use_simd)
+      row_avx2(row0, row1, dst);
+    else
+#elif defined(PREPROCESS_NEON)
+    if (use_simd)
+      row_neon(row0, row1, dst);
+    else
+#endif
+      row_scalar(row0, row1, dst);
+  }
+}
+
+void palette_gray_lut(const uint8_t* palette_rgb, uint8_t* lut)
+{
+  for (int i = 0; i < 256; i++)
+    lut[i] = gray_scalar(palette_rgb + i * 3);
+}
+
+void preprocess_indexed_fused(const uint8_t* screen, int screen_width, int crop_x, int crop_y, const uint8_t* lut, uint8_t* out)
+{
+  for (int y = 0; y < OBS_SIZE; y++)
+  {
+    const uint8_t* row0 = screen + (crop_y + 2 * y) * screen_width + crop_x;
+    const uint8_t* row1 = row0 + screen_width;
+    uint8_t* dst = out + y * (OBS_SIZE / 8);
+
+    for (int x = 0; x < OBS_SIZE; x += 8)
+    {
+      uint8_t bits = 0;
+
+      for (int k = 0; k < 8; k++)
+      {
+        const uint8_t* a = row0 + (x + k) * 2;
+        const uint8_t* b = row1 + (x + k) * 2;
+
+        int sum = lut[a[0]] + lut[a[1]] + lut[b[0]] + lut[b[1]];
+
+        if (((sum + 2) >> 2) > THRESHOLD)
+          bits |= 1 << k;
+      }
+
+      dst[x / 8] = bits;
+    }
+  }
+}
+
+void pack_obs(const uint8_t* frame, uint8_t* out)
+{
+#if defined(PREPROCESS_AVX2)
+  if (use_simd)
+    return pack_avx2(frame, out);
+#elif defined(PREPROCESS_NEON)
+  if (use_simd)
+    return pack_neon(frame, out);
+#endif
+
+  for (int i = 0; i < OBS_SIZE * OBS_SIZE; i += 8)
+  {
+    uint8_t bits = 0;
+
+    for (int k = 0; k < 8; k++)
+      if (frame[i + k])
+        bits |= 1 << k;
+
+    out[i / 8] = bits;
+  }
+}
+
+void unpack_obs(const uint8_t* packed, float* out, size_t bytes)
+{
+#if defined(PREPROCESS_AVX2)
+  if (use_simd)
+    return unpack_avx2(packed, out, bytes);
+#elif defined(PREPROCESS_NEON)
+  if (use_simd)
+    return unpack_neon(packed, out, bytes);
+#endif
+
+  for (size_t i = 0; i < bytes; i++)
+    for (int k = 0; k < 8; k++)
+      out[i * 8 + k] = (packed[i] >> k) & 1;
+}
@@ -0,0 +1,97 @@
+/**
+ * @file preprocess.h
+ * @brief Fused observation preprocessing kernels
+ */
+
+#ifndef AFDRL_PREPROCESS_H
+#define AFDRL_PREPROCESS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Width and height of a preprocessed observation.
+static const int OBS_SIZE = 80;
+
+// Bytes of a bit-packed observation. Pixels are binary, so each byte holds
+// 8 consecutive pixels of a row, the first one in the least significant bit.
+static const int OBS_PACKED = OBS_SIZE * OBS_SIZE / 8;
+
+/**
+ * Enables or disables the AVX2/NEON kernels, which are on by default when
+ * the CPU supports them. Their output is bit-identical to the scalar
+ * fallback; switching them off exists to check that.
+ *
+ * @param enable Whether to use the vector kernels.
+ * @return Whether the vector kernels are now in use.
+ */
+bool preprocess_use_simd(bool enable);
+
+/**
+ * Checks whether the fused kernel can handle a crop. The kernel only
+ * implements the exact 2x downsample from a (2 * OBS_SIZE)^2 crop.
+ *
+ * @param crop_width The crop width.
+ * @param crop_height The crop height.
+ * @return Whether preprocess_rgb_fused() supports the crop.
+ */
+bool preprocess_fused_supported(int crop_width, int crop_height);
+
+/**
+ * Crops, converts to grayscale, downsamples 2x, thresholds and bit-packs an
+ * RGB screen in a single pass, using AVX2 or NEON when the CPU has them.
+ *
+ * The output is bit-identical to cv::cvtColor(COLOR_RGB2GRAY) followed by
+ * cv::resize(INTER_LINEAR) to OBS_SIZE x OBS_SIZE,
+ * cv::threshold(128, 255, THRESH_BINARY) and pack_obs(): OpenCV performs an
+ * exact 2x INTER_LINEAR shrink as a rounded 2x2 box average.
+ *
+ * @param rgb The packed RGB screen.
+ * @param screen_width The screen width in pixels.
+ * @param crop_x The left edge of the crop.
+ * @param crop_y The top edge of the crop.
+ * @param out The output buffer, OBS_PACKED bytes.
+ */
+void preprocess_rgb_fused(const uint8_t* rgb, int screen_width, int crop_x, int crop_y, uint8_t* out);
+
+/**
+ * Builds the gray level of every palette index, with the same luma weights
+ * and rounding as preprocess_rgb_fused().
+ *
+ * @param palette_rgb The RGB colour of each index, 256 * 3 bytes.
+ * @param lut The output table, 256 bytes.
+ */
+void palette_gray_lut(const uint8_t* palette_rgb, uint8_t* lut);
+
+/**
+ * Crops, downsamples 2x, thresholds and bit-packs an indexed screen in a
+ * single pass, reading gray levels from a palette table instead of
+ * converting RGB. With a table from palette_gray_lut(), the output is
+ * bit-identical to preprocess_rgb_fused() on the same screen in RGB.
+ *
+ * @param screen The screen as palette indices, one byte per pixel.
+ * @param screen_width The screen width in pixels.
+ * @param crop_x The left edge of the crop.
+ * @param crop_y The top edge of the crop.
+ * @param lut The gray level of each palette index, 256 bytes.
+ * @param out The output buffer, OBS_PACKED bytes.
+ */
+void preprocess_indexed_fused(const uint8_t* screen, int screen_width, int crop_x, int crop_y, const uint8_t* lut, uint8_t* out);
+
+/**
+ * Bit-packs a binary observation.
+ *
+ * @param frame The observation, OBS_SIZE * OBS_SIZE bytes of 0 or 255.
+ * @param out The output buffer, OBS_PACKED bytes.
+ */
+void pack_obs(const uint8_t* frame, uint8_t* out);
+
+/**
+ * Expands bit-packed observations to float pixels of 0 or 1.
+ *
+ * @param packed The packed observations.
+ * @param out The output buffer, 8 floats per packed byte.
+ * @param bytes The number of packed bytes.
+ */
+void unpack_obs(const uint8_t* packed, float* out, size_t bytes);
+
+#endif
@@ -0,0 +1,187 @@
+/**
+ * @file resetpool.cpp
+ * @brief Pre-generated episode start states
+ */
+
+#include "resetpool.h"
+#include "log.h"
+#include "preprocess.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * FNV-1a over a byte range, continuing from h.
+ */
+static uint64_t fnv1a(uint64_t h, const void* data, size_t size)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+
+  for (size_t i = 0; i < size; i++)
+  {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+/**
+ * Identifies what a pool was generated from, so a stale file is not reused.
+ */
+static uint64_t config_hash(const std::string& rom_path, const EnvConfig& config, int max_noops, int seed)
+{
+  int fields[] = {
+    config.frame_skip, config.frame_stack,
+    config.crop_x, config.crop_y, config.crop_width, config.crop_height,
+    (int) config.preprocess, config.max_pool, OBS_PACKED, max_noops, seed,
+  };
+
+  uint64_t h = 0xcbf29ce484222325ULL;
+  h = fnv1a(h, rom_path.data(), rom_path.size());
+  h = fnv1a(h, fields, sizeof(fields));
+
+  return h;
+}
+
+ResetPool::ResetPool(const std::string& rom_path, const EnvConfig& config, int count, int max_noops, int seed, const std::string& path)
+{
+  if (count < 1)
+    throw runtime_error("reset pool needs at least one state");
+
+  uint64_t hash = config_hash(rom_path, config, max_noops, seed);
+
+  if (!path.empty() && map_file(path, hash, count))
+  {
+    log_debug("Mapped %d reset states from %s", count, path.c_str());
+    return;
+  }
+
+  // Generate the states on a private emulator
+  AtariEnv env(rom_path, config, seed, false);
+  minstd_rand rng(seed);
+  uniform_int_distribution<int> noop_dist(0, max_noops);
+
+  vector<vector<char>> states;
+
+  for (int i = 0; i < count; i++)
+  {
+    env.reset();
+
+    // Action 0 of every minimal action set is NOOP
+    int noops = noop_dist(rng);
+    for (int j = 0; j < noops; j++)
+      if (std::get<2>(env.step(0)))
+        env.reset();
+
+    // Leave the random generator out, so every episode keeps its own
+    states.push_back(env.serialize(false));
+  }
+
+  size_t table = sizeof(ResetPoolHeader) + (count + 1) * sizeof(uint64_t);
+  size_t total = table;
+
+  for (auto& s : states)
+    total += s.size();
+
+  owned.resize(total);
+
+  ResetPoolHeader h;
+  h.magic = RESET_POOL_MAGIC;
+  h.count = count;
+  h.config = hash;
+  memcpy(owned.data(), &h, sizeof(h));
+
+  uint64_t* offs = reinterpret_cast<uint64_t*>(owned.data() + sizeof(h));
+  uint64_t offset = table;
+
+  for (int i = 0; i < count; i++)
+  {
+    offs[i] = offset;
+    memcpy(owned.data() + offset, states[i].data(), states[i].size());
+    offset += states[i].size();
+  }
+
+  offs[count] = offset;
+  base = owned.data();
+
+  log_debug("Generated %d reset states (%zu bytes)", count, total);
+
+  if (path.empty())
+    return;
+
+  // Publish the file atomically, then share its pages instead of our copy
+  string tmp = path + "." + to_string(getpid());
+  FILE* f = fopen(tmp.c_str(), "wb");
+
+  if (!f || fwrite(owned.data(), 1, owned.size(), f) != owned.size() || fclose(f))
+  {
+    log_warn("could not write reset pool %s", path.c_str());
+    return;
+  }
+
+  if (rename(tmp.c_str(), path.c_str()))
+  {
+    unlink(tmp.c_str());
+    return;
+  }
+
+  if (map_file(path, hash, count))
+    vector<char>().swap(owned);
+}
+
+ResetPool::~ResetPool()
+{
+  if (map)
+    munmap(map, map_size);
+}
+
+bool ResetPool::map_file(const std::string& path, uint64_t hash, int count)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+
+  if (fstat(fd, &st) || (size_t) st.st_size < sizeof(ResetPoolHeader) + (count + 1) * sizeof(uint64_t))
+  {
+    close(fd);
+    return false;
+  }
+
+  void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (m == MAP_FAILED)
+    return false;
+
+  const ResetPoolHeader* h = static_cast<const ResetPoolHeader*>(m);
+  const uint64_t* offs = reinterpret_cast<const uint64_t*>(h + 1);
+
+  if (h->magic != RESET_POOL_MAGIC || h->config != hash || (int) h->count != count
+      || offs[count] != (uint64_t) st.st_size)
+  {
+    munmap(m, st.st_size);
+    return false;
+  }
+
+  if (map)
+    munmap(map, map_size);
+
+  map = m;
+  map_size = st.st_size;
+  base = static_cast<const char*>(m);
+
+  return true;
+}
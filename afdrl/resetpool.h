@@ -0,0 +1,103 @@
+/**
+ * @file resetpool.h
+ * @brief Pre-generated episode start states
+ */
+
+#ifndef AFDRL_RESETPOOL_H
+#define AFDRL_RESETPOOL_H
+
+#include "env.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reset pool file identification ("AFDR").
+static const uint32_t RESET_POOL_MAGIC = 0x52444641;
+
+/**
+ * Header of a reset pool, in memory and on disk. count + 1 uint64 offsets
+ * follow, then the serialized environment states (see AtariEnv::serialize)
+ * back to back; state i spans [offsets[i], offsets[i + 1]).
+ */
+struct ResetPoolHeader
+{
+  uint32_t magic;    // RESET_POOL_MAGIC
+  uint32_t count;    // number of states
+  uint64_t config;   // hash of the game and environment config
+};
+
+/**
+ * Read-only set of episode start states, each reached with a random number
+ * of no-ops after a game reset. Environments given a pool reset by
+ * restoring one of its states instead of resetting the game.
+ *
+ * Nothing is modified after construction, so a pool can be shared between
+ * threads. Loaded from a file, the pages are shared with every process on
+ * the node mapping the same file.
+ */
+class ResetPool
+{
+public:
+    /**
+     * Generates the states, or maps them from a file.
+     *
+     * If path names an existing pool for the same config and count, it is
+     * mapped read-only. Otherwise the states are generated and, if path is
+     * set, written there for other processes.
+     *
+     * @param rom_path The path to the ROM file.
+     * @param config The environment configuration.
+     * @param count Number of states.
+     * @param max_noops Most no-ops taken after the game reset.
+     * @param seed Seed of the no-op counts and of the generating emulator.
+     * @param path Shared pool file (empty = keep in memory).
+     */
+    ResetPool(const std::string& rom_path, const EnvConfig& config, int count, int max_noops, int seed, const std::string& path);
+
+    ~ResetPool();
+
+    ResetPool(const ResetPool&) = delete;
+    ResetPool& operator=(const ResetPool&) = delete;
+
+    /**
+     * Get the number of states.
+     */
+    int size() const { return header()->count; }
+
+    /**
+     * Get a serialized state.
+     *
+     * @param i The state index.
+     * @return The state bytes, state_size(i) long.
+     */
+    const char* state(int i) const { return base + offsets()[i]; }
+
+    /**
+     * Get the size of a serialized state.
+     */
+    size_t state_size(int i) const { return offsets()[i + 1] - offsets()[i]; }
+
+private:
+    const ResetPoolHeader* header() const { return reinterpret_cast<const ResetPoolHeader*>(base); }
+    const uint64_t* offsets() const { return reinterpret_cast<const uint64_t*>(base + sizeof(ResetPoolHeader)); }
+
+    /**
+     * Maps a pool file, if it matches.
+     *
+     * @return Whether the file was mapped.
+     */
+    bool map_file(const std::string& path, uint64_t config_hash, int count);
+
+    // Generated pool
+    std::vector<char> owned;
+
+    // Mapped pool file
+    void* map = nullptr;
+    size_t map_size = 0;
+
+    // Start of the pool, in either
+    const char* base = nullptr;
+};
+
+#endif
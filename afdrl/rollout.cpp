@@ -0,0 +1,66 @@
+/**
+ * @file rollout.cpp
+ * @brief Preallocated rollout storage for sequence-batched training
+ */
+
+#include "rollout.h"
+#include "preprocess.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+RolloutBuffer::RolloutBuffer(int steps, int envs, int channels, torch::Device device)
+  : steps(steps)
+{
+  // Allocated outside of any inference scope, so the recorded steps stay
+  // usable by autograd
+  auto options = torch::TensorOptions().device(device);
+
+  frames = torch::empty({steps, envs, channels, OBS_PACKED}, options.dtype(torch::kUInt8));
+  actions = torch::empty({steps, envs}, options.dtype(torch::kInt64));
+  rewards = torch::empty({steps, envs}, torch::kFloat32);
+  masks = torch::empty({steps, envs}, torch::kFloat32);
+}
+
+void RolloutBuffer::push_frames(const torch::Tensor& f)
+{
+  if (length == steps)
+    throw runtime_error("rollout buffer is full");
+
+  frames[length].copy_(f);
+  started = true;
+}
+
+void RolloutBuffer::push_step(const torch::Tensor& a, const torch::Tensor& r, const torch::Tensor& m)
+{
+  if (!started)
+    throw runtime_error("rollout step without frames");
+
+  actions[length].copy_(a);
+  rewards[length].copy_(r);
+  masks[length].copy_(m);
+
+  started = false;
+  length++;
+}
+
+torch::Tensor RolloutBuffer::get_frames() const
+{
+  return frames.slice(0, 0, length).flatten(0, 1);
+}
+
+torch::Tensor RolloutBuffer::get_actions() const
+{
+  return actions.slice(0, 0, length);
+}
+
+torch::Tensor RolloutBuffer::get_rewards() const
+{
+  return rewards.slice(0, 0, length);
+}
+
+torch::Tensor RolloutBuffer::get_masks() const
+{
+  return masks.slice(0, 0, length);
+}
@@ -0,0 +1,80 @@
+/**
+ * @file rollout.h
+ * @brief Preallocated rollout storage for sequence-batched training
+ */
+
+#ifndef AFDRL_ROLLOUT_H
+#define AFDRL_ROLLOUT_H
+
+#include "torch_pch.h"
+
+/**
+ * Structure-of-arrays record of one rollout of up to T steps over N
+ * environments. Acting fills it without autograd; the learner then
+ * recomputes the model over all recorded frames in one batch.
+ *
+ * The tensors are allocated once and overwritten by every rollout.
+ */
+class RolloutBuffer
+{
+public:
+    /**
+     * Allocates the buffer.
+     *
+     * @param steps Maximum rollout length T.
+     * @param envs Number of environments N.
+     * @param channels Frames per observation.
+     * @param device Device of the frames and actions.
+     */
+    RolloutBuffer(int steps, int envs, int channels, torch::Device device);
+
+    /**
+     * Starts a step at the end of the rollout by copying the observations
+     * the actions will be taken in. Call it before stepping the
+     * environments, which overwrite their observations in place.
+     *
+     * @param frames Observations [N, C, OBS_PACKED] (packed uint8).
+     */
+    void push_frames(const torch::Tensor& frames);
+
+    /**
+     * Completes the step started by push_frames().
+     *
+     * @param actions Actions taken [N] (int64).
+     * @param rewards Clipped rewards [N] (CPU).
+     * @param masks Continuation masks [N], 0 after a terminal step (CPU).
+     */
+    void push_step(const torch::Tensor& actions, const torch::Tensor& rewards, const torch::Tensor& masks);
+
+    /**
+     * Forgets the recorded steps.
+     */
+    void clear() { length = 0; started = false; }
+
+    int size() const { return length; }
+    int capacity() const { return steps; }
+    bool full() const { return length == steps; }
+
+    /**
+     * Views of the recorded steps. The frames are flattened to
+     * [size * N, C, OBS_PACKED] for the batched trunk; the others are [size, N].
+     */
+    torch::Tensor get_frames() const;
+    torch::Tensor get_actions() const;
+    torch::Tensor get_rewards() const;
+    torch::Tensor get_masks() const;
+
+private:
+    int steps;
+    int length = 0;
+
+    // Whether frames[length] holds the observations of a started step
+    bool started = false;
+
+    torch::Tensor frames;   // [T, N, C, OBS_PACKED] packed uint8
+    torch::Tensor actions;  // [T, N] int64
+    torch::Tensor rewards;  // [T, N] float, CPU
+    torch::Tensor masks;    // [T, N] float, CPU
+};
+
+#endif
@@ -6,16 +6,26 @@
 #include "schedule.h"
 #include "log.h"
 
-#include <iostream>
+#include <cstring>
+#include <map>
+#include <memory>
 #include <stdexcept>
+#include <queue>
 #include <random>
 #include <set>
+#include <tuple>
 #include <mpi.h>
 
 #include <signal.h>
 
+#include "aggregate.h"
+#include "codec.h"
 #include "messages.h"
+#include "metrics.h"
 #include "model.h"
+#include "sharedmodel.h"
+#include "subaggregate.h"
+#include "updatepool.h"
 
 using namespace std;
 
@@ -42,12 +52,11 @@ using namespace std;
 
 class ClientSchedule {
   public:
-    ClientSchedule(int seed, int minspace, int maxspace, int minlen, int maxlen, int steps_ratio, int steps_var, int chan, int actions)
+    ClientSchedule(int seed, int minspace, int maxspace, int minlen, int maxlen, int steps_ratio, int steps_var)
       : length_dist(minlen, maxlen),
         space_dist(minspace, maxspace),
         steps_ratio(steps_ratio),
-        steps_var(steps_var),
-        model(chan, actions)
+        steps_var(steps_var)
     {
       // Initialize job rng
       job_rng.seed(seed);
@@ -64,12 +73,35 @@ class ClientSchedule {
       EARLY,   // the job completed before the finish time step
     } status;
 
+    int client = -1;
     int start_time;
     int end_time;
     int steps;
     int steps_var, steps_ratio;
 
-    LSTMModel model;
+    // Global model version the current job was sent, then the one it
+    // actually trained from once its update arrives (with a shared model,
+    // the node's window may have held a newer one)
+    int start_version = -1;
+
+    // Encoded model delta (see codec.h) in the update pool, held only
+    // while EARLY (-1 = none)
+    int update = -1;
+
+    // Sub-aggregator holding the delta instead (-1 = none)
+    int holder = -1;
+
+    // Optimizer state from the client's last job in the update pool, shipped
+    // with its next job (-1 = none)
+    int optim_state = -1;
+
+    // Environment and hidden state where the client's last job stopped
+    // (see agent.h), in the update pool (-1 = none)
+    int env_state = -1;
+
+    // Error-feedback residual of the client's last update (see codec.h), in
+    // the update pool (-1 = none)
+    int residual = -1;
 
     /**
      * Advance the schedule sequence.
@@ -95,40 +127,155 @@ class ClientSchedule {
     }
 
   private:
-    mt19937 job_rng;
+    // Small-state engine: one per client, so mt19937's 5 KB would dominate
+    // memory with many clients
+    minstd_rand job_rng;
 
     uniform_int_distribution<int> length_dist, space_dist, step_dist;
 };
 
-static int mpi_size;
-
-void sigint_handler(int sig)
+/**
+ * A point in simulated time where a client's job starts or joins.
+ */
+struct ScheduleEvent
 {
-  // Send STOP to all test/train processes
-  for (int i = 1; i < mpi_size; i++)
+  enum Type {
+    START, // the job becomes available to workers
+    END,   // the job joins the federation
+  };
+
+  int time;
+  Type type;
+  int client;
+
+  // Ordered by time, then starts before ends, then by client index
+  bool operator>(const ScheduleEvent& other) const
   {
-    sendInt(i, MSG_STOP);
+    return tie(time, type, client) > tie(other.time, other.type, other.client);
   }
+};
+
+typedef priority_queue<ScheduleEvent, vector<ScheduleEvent>, greater<ScheduleEvent>> EventQueue;
+
+/**
+ * Queues the start and end events of a client's current job.
+ */
+static void push_events(EventQueue& events, const ClientSchedule& schedule, int client)
+{
+  events.push({schedule.start_time, ScheduleEvent::START, client});
+  events.push({schedule.end_time, ScheduleEvent::END, client});
+}
+
+/**
+ * Versioned serialized form of the global model. The version increases with
+ * every merge, and the serialized bytes are built at most once per version
+ * and shared by every send of that version.
+ */
+class ModelSnapshot {
+  public:
+    ModelSnapshot(LSTMModel& model)
+      : model(model), version(0), built_version(-1)
+    {
+    }
+
+    /**
+     * Marks the global model as changed.
+     */
+    void bump() { version++; }
+
+    /**
+     * Get the current global model version.
+     */
+    int get_version() const { return version; }
+
+    /**
+     * Get the serialized model for the current version.
+     *
+     * @return The shared serialized model.
+     */
+    shared_ptr<const vector<char>> get()
+    {
+      if (built_version != version)
+      {
+        // Reuse the buffer unless a send still references the old version
+        if (!bytes || bytes.use_count() > 1)
+          bytes = make_shared<vector<char>>();
+
+        model.serialize_into(*bytes);
+        built_version = version;
+      }
+
+      return bytes;
+    }
+
+  private:
+    LSTMModel& model;
+
+    int version;
+    int built_version;
+    shared_ptr<vector<char>> bytes;
+};
+
+// Set by SIGINT; the scheduler stops all ranks at the next message
+static volatile sig_atomic_t stop_requested = 0;
+
+void sigint_handler(int sig)
+{
+  stop_requested = 1;
 }
 
-void merge_model(LSTMModel& dest, ClientSchedule& from)
+/**
+ * Describes the current job of a client for merging.
+ */
+static MergeInfo merge_info(const ClientSchedule& from, int version)
 {
-  // TODO: merge strategy
-  dest.add(from.model, 1.0f);
-
-  // Write the model update to stdout
-  cout << "===> Global model updates from " << from.start_time << " -> " << from.end_time << " over " << from.steps << " steps" << endl;
-  cout << "Delta:" << endl;
-  from.model.print();
-  cout << "====\nNew parameters:" << endl;
-  dest.print();
-  cout << "<===" << endl;
+  MergeInfo info;
+  info.client = from.client;
+  info.steps = from.steps;
+  info.start_time = from.start_time;
+  info.end_time = from.end_time;
+  info.start_version = from.start_version;
+  info.version = version;
+
+  return info;
 }
 
-int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig config)
+bool merge_model(Aggregator& aggregator, LSTMModel& dest, ClientSchedule& from, UpdatePool& updates, int version, MetricsSink& metrics, size_t queued)
 {
-  mpi_size = size;
+  const char* update = updates.data(from.update);
+  size_t update_bytes = updates.size(from.update);
+
+  MergeInfo info = merge_info(from, version);
 
+  MergeRecord record;
+  record.F_time = from.end_time;
+  record.client = from.client;
+  record.steps = from.steps;
+  record.start_time = from.start_time;
+  record.staleness = version - from.start_version;
+  record.bytes = update_bytes;
+  record.norm = update_norm(update, update_bytes);
+
+  bool changed = aggregator.merge(update, update_bytes, info);
+
+  // Return the update storage to the pool
+  updates.release(from.update);
+  from.update = -1;
+
+  record.applied = changed;
+  record.version = version + changed;
+  record.queue = queued;
+  record.held = updates.get_memory_bytes() + updates.get_spilled_bytes();
+
+  metrics.merge(record, dest);
+
+  log_debug("Merged client %d (%d -> %d, %d steps, %zu bytes)", from.client, from.start_time, from.end_time, from.steps, update_bytes);
+
+  return changed;
+}
+
+int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig config, const AggregationTree& tree)
+{
   // Initialize a shared global environment (for parameters)
   AtariEnv* env = new AtariEnv(rom_path, config, -1, false);
 
@@ -138,6 +285,9 @@ int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig conf
       env->get_num_actions()
   );
 
+  if (args.flat_params)
+    model.flatten();
+
   // Set CTRL-C handler
   signal(SIGINT, sigint_handler);
 
@@ -156,49 +306,239 @@ int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig conf
       args.min_offline_time,
       args.max_offline_time,
       args.steps_ratio,
-      args.steps_var,
-      env->get_screen_channels(),
-      env->get_num_actions()
+      args.steps_var
     );
+
+    schedules.back().client = i;
   }
 
   delete env;
   env = nullptr;
 
+  // Queue the first job of every client. Simulated time skips straight from
+  // one event to the next, so idle ticks cost nothing.
+  EventQueue events;
+
+  for (int i = 0; i < schedules.size(); i++)
+    push_events(events, schedules[i], i);
+
+  MessageLayer messages;
+  ModelSnapshot snapshot(model);
+
+  // Node windows for the global model, and the version last published (or
+  // handed to a rank to publish) on each node
+  SharedModel shared(sizeof(ModelHeader) + model.payload_bytes(), args.model_transport == "shared");
+  vector<int> published(size, -1);
+
+  // Merge strategy for client updates
+  unique_ptr<Aggregator> aggregator = make_aggregator(args, model);
+
+  // Sums only stand in for their updates under linear merge rules
+  if (!tree.sub_aggregators.empty() && !aggregator->is_linear())
+    throw runtime_error("sub-aggregators need a linear aggregator, got " + args.aggregator);
+
+  // Merge records for post-processing
+  MetricsSink metrics(args.results_file, args.param_stats_every);
+
+  // Storage for updates of clients that finish before their join time, and
+  // for client optimizer states
+  UpdatePool updates((size_t) args.update_memory << 20, args.update_spill);
+
+  // Sends a reply carrying the global model, without the payload when the
+  // requester already holds the current version. With a shared model, the
+  // first rank of a node to need a version receives it and publishes it for
+  // the others; the scheduler publishes to its own node directly.
+  auto send_model = [&](int dest, const MessageHeader& request, MessageHeader header)
+  {
+    int version = snapshot.get_version();
+    header.version = version;
+
+    if (request.version == version)
+    {
+      messages.send(dest, header);
+      return;
+    }
+
+    if (!shared.is_enabled())
+    {
+      messages.send(dest, header, snapshot.get());
+      return;
+    }
+
+    int node = shared.get_node(dest);
+
+    if (published[node] != version)
+    {
+      published[node] = version;
+
+      if (node != shared.get_node(rank))
+      {
+        header.model = MODEL_PUBLISH;
+        messages.send(dest, header, snapshot.get());
+        return;
+      }
+
+      auto bytes = snapshot.get();
+      shared.publish(version, bytes->data(), bytes->size());
+    }
+
+    header.model = MODEL_SHARED;
+    messages.send(dest, header);
+  };
+
+  // Model requests waiting for a version they asked for, by source rank
+  map<int, MessageHeader> watchers;
+
   int F_time = 0;
 
-  while (F_time < args.num_steps)
+  // Answers the model requests whose version has arrived
+  auto notify_watchers = [&]()
   {
-    // We will process all updates required at this timestep
-    // First, collect any schedules pending to start now.
+    int version = snapshot.get_version();
 
-    set<int> pending;
+    for (auto it = watchers.begin(); it != watchers.end(); )
+    {
+      const MessageHeader& request = it->second;
+
+      if (version <= request.version || version % request.arg[0] != request.arg[1])
+      {
+        ++it;
+        continue;
+      }
+
+      MessageHeader header = message_header(MSG_GLOBAL_MODEL);
+      header.arg[0] = F_time;
+      header.arg[1] = total_updates;
+      header.arg[2] = total_trajectories;
+
+      send_model(it->first, request, header);
+      it = watchers.erase(it);
+    }
+  };
+
+  // Jobs joining now whose updates a sub-aggregator holds, by holder. They
+  // are merged as one sum per holder once every job joining now is in.
+  map<int, vector<MergeInfo>> deferred;
 
-    for (int i = 0; i < schedules.size(); i++)
+  // Merges a joining job's update, or defers it to its sub-aggregator's
+  // sum, and moves the client on to its next job
+  auto merge_client = [&](int i)
+  {
+    if (schedules[i].holder >= 0)
+    {
+      deferred[schedules[i].holder].push_back(merge_info(schedules[i], snapshot.get_version()));
+      schedules[i].holder = -1;
+    }
+    else if (merge_model(*aggregator, model, schedules[i], updates, snapshot.get_version(), metrics, events.size()))
     {
-      if (schedules[i].status == ClientSchedule::PENDING && schedules[i].start_time == F_time)
+      snapshot.bump();
+      total_updates++;
+    }
+
+    schedules[i].advance(F_time);
+    push_events(events, schedules[i], i);
+  };
+
+  // Has every sub-aggregator sum its deferred updates, and merges the sums
+  auto merge_deferred = [&]()
+  {
+    for (auto& entry : deferred)
+    {
+      int holder = entry.first;
+      vector<MergeInfo>& infos = entry.second;
+
+      vector<SubAggregateEntry> request(infos.size());
+      double total_weight = 0;
+
+      for (size_t k = 0; k < infos.size(); k++)
       {
-        // Found a pending job
-        pending.insert(i);
+        request[k] = {};
+        request[k].client = infos[k].client;
+        request[k].weight = aggregator->weight(infos[k]);
+        total_weight += request[k].weight;
+      }
+
+      MessageHeader header = message_header(MSG_FLUSH_UPDATES);
+      header.arg[0] = request.size();
+      header.length = request.size() * sizeof(SubAggregateEntry);
+      messages.send(holder, header, request.data());
+
+      Message reply = messages.recv(holder, MSG_COMBINED_UPDATE);
+
+      size_t entries = request.size() * sizeof(SubAggregateEntry);
+      if (reply.header.arg[0] != (int) request.size() || reply.length() < entries)
+        throw runtime_error("corrupt combined update");
+
+      memcpy(request.data(), reply.payload(), entries);
+
+      int version = snapshot.get_version();
+      bool changed = aggregator->merge_sum(reply.payload() + entries, reply.length() - entries, total_weight);
+
+      // One record per client, as if merged one by one
+      for (size_t k = 0; k < infos.size(); k++)
+      {
+        MergeRecord record;
+        record.F_time = infos[k].end_time;
+        record.client = infos[k].client;
+        record.steps = infos[k].steps;
+        record.start_time = infos[k].start_time;
+        record.staleness = version - infos[k].start_version;
+        record.bytes = request[k].bytes;
+        record.norm = request[k].norm;
+        record.applied = changed;
+        record.version = version + changed;
+        record.queue = events.size();
+        record.held = updates.get_memory_bytes() + updates.get_spilled_bytes();
+
+        metrics.merge(record, model);
+      }
+
+      messages.recycle(reply);
+
+      log_debug("Merged %zu updates combined by %d", infos.size(), holder);
+
+      if (changed)
+      {
+        snapshot.bump();
+        total_updates++;
       }
     }
 
-    // We then collect jobs waiting to join at this timestep
+    deferred.clear();
+  };
+
+  while (!events.empty() && !stop_requested)
+  {
+    F_time = events.top().time;
+
+    if (F_time >= args.num_steps)
+      break;
+
+    // Collect every event at this time step: jobs pending to start now and
+    // jobs joining now.
+    set<int> pending;
     set<int> waiting;
 
-    for (int i = 0; i < schedules.size(); i++)
+    while (!events.empty() && events.top().time == F_time)
     {
-      if (schedules[i].end_time != F_time)
+      ScheduleEvent event = events.top();
+      events.pop();
+
+      int i = event.client;
+
+      if (event.type == ScheduleEvent::START)
+      {
+        // Found a pending job
+        pending.insert(i);
         continue;
+      }
 
       // The job will join on this timestep. Is it already complete?
       if (schedules[i].status == ClientSchedule::EARLY)
       {
         // The job is already complete
         // Merge the waiting parameters and advance the job
-
-        merge_model(model, schedules[i]);
-        schedules[i].advance(F_time);
+        merge_client(i);
       }
       else
       {
@@ -211,16 +551,14 @@ int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig conf
     // We have lists of active jobs. Continue processing messages until each
     // required job is complete.
 
-    while (!waiting.empty() || !pending.empty())
+    while ((!waiting.empty() || !pending.empty()) && !stop_requested)
     {
-      // Read next message source
-      int source = recvInt(MPI_ANY_SOURCE);
-
-      // Read next message
-      int msg = recvInt(source);
+      // Wait for the next message from any rank
+      Message msg = messages.recv();
+      int source = msg.source;
 
       // Handle message
-      switch (msg)
+      switch (msg.header.type)
       {
         case MSG_GET_SCHEDULE:
           {
@@ -229,19 +567,11 @@ int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig conf
 
             if (pending.empty())
             {
-              sendInt(source, MSG_SLEEP);
+              messages.send(source, message_header(MSG_SLEEP));
               break;
             }
 
             int i = *pending.begin();
-            
-            // Send schedule information
-            sendInt(source, MSG_SCHEDULE);            // Message type
-            sendInt(source, schedules[i].steps);      // Number of steps
-            sendInt(source, i);                       // Schedule index
-
-            vector<char> params = model.serialize();
-            sendBuffer(source, params); // Model parameters
 
             // Check sanity
             if (schedules[i].status != ClientSchedule::PENDING)
@@ -249,28 +579,66 @@ int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig conf
             if (schedules[i].end_time <= F_time)
               throw runtime_error("Invalid schedule end time");
 
+            // Send schedule information and model parameters together
+            MessageHeader header = message_header(MSG_SCHEDULE, i);
+            header.arg[0] = schedules[i].steps;
+            header.arg[1] = schedules[i].optim_state >= 0;
+            header.arg[2] = schedules[i].env_state >= 0;
+            header.arg[3] = schedules[i].residual >= 0;
+
+            send_model(source, msg.header, header);
+
+            if (schedules[i].optim_state >= 0)
+            {
+              MessageHeader state = message_header(MSG_OPTIM_STATE, i);
+              state.length = updates.size(schedules[i].optim_state);
+              messages.send(source, state, updates.data(schedules[i].optim_state));
+            }
+
+            if (schedules[i].env_state >= 0)
+            {
+              MessageHeader state = message_header(MSG_CLIENT_STATE, i);
+              state.length = updates.size(schedules[i].env_state);
+              messages.send(source, state, updates.data(schedules[i].env_state));
+            }
+
+            if (schedules[i].residual >= 0)
+            {
+              MessageHeader state = message_header(MSG_RESIDUAL, i);
+              state.length = updates.size(schedules[i].residual);
+              messages.send(source, state, updates.data(schedules[i].residual));
+            }
+
             // Write debug info
             log_debug("Sent schedule %d to %d", i, source);
 
             // Mark job as waiting
             schedules[i].status = ClientSchedule::WAITING;
+            schedules[i].start_version = snapshot.get_version();
             pending.erase(i);
           }
           break;
         case MSG_UPDATE_GLOBAL_MODEL:
           // The client has an update for us
           {
-            // Receive job index
-            int i = recvInt(source);
-
-            // Receive update parameters
-            vector<char> buffer = recvBuffer(source);
-            schedules[i].model.deserialize(buffer);
+            int i = msg.header.job;
 
             // Sanity check
+            if (i < 0 || i >= (int) schedules.size())
+              throw runtime_error("Invalid schedule index");
             if (schedules[i].status != ClientSchedule::WAITING)
               throw runtime_error("Invalid schedule status");
 
+            if (msg.header.version > schedules[i].start_version)
+              schedules[i].start_version = msg.header.version;
+
+            // Keep the encoded update, decoded at merge time, unless the
+            // sender's sub-aggregator keeps it
+            if (msg.header.arg[0])
+              schedules[i].holder = tree.parent[source];
+            else
+              schedules[i].update = updates.store(msg.payload(), msg.length());
+
             // If the model is joining later, we wait for later timesteps
             if (schedules[i].end_time > F_time)
             {
@@ -280,42 +648,133 @@ int schedule(int rank, int size, Args args, std::string rom_path, EnvConfig conf
             }
 
             // Otherwise, the job is merging now
-            merge_model(model, schedules[i]);
-            schedules[i].advance(F_time);
+            merge_client(i);
 
             // remove from waiting list
             waiting.erase(i);
           }
           break;
-        case MSG_GET_GLOBAL_MODEL:
-          // Send global model
+        case MSG_OPTIM_STATE:
+          // The client's optimizer state after its job, kept for its next
           {
-            // Send message type
-            sendInt(source, MSG_GLOBAL_MODEL);
-            
-            // Serialize global model to buffer
-            vector<char> buffer = model.serialize();
-            sendBuffer(source, buffer);
+            int i = msg.header.job;
 
-            // Send federation time
-            sendInt(source, F_time);
+            if (i < 0 || i >= (int) schedules.size())
+              throw runtime_error("Invalid schedule index");
 
-            // Send global update count
-            sendInt(source, total_updates);
+            if (schedules[i].optim_state >= 0)
+              updates.release(schedules[i].optim_state);
 
-            // Send total trajectory count
-            sendInt(source, total_trajectories);
+            schedules[i].optim_state = updates.store(msg.payload(), msg.length());
+          }
+          break;
+        case MSG_CLIENT_STATE:
+          // Where the client's episode stopped, to be resumed by its next job
+          {
+            int i = msg.header.job;
+
+            if (i < 0 || i >= (int) schedules.size())
+              throw runtime_error("Invalid schedule index");
+
+            if (schedules[i].env_state >= 0)
+              updates.release(schedules[i].env_state);
+
+            schedules[i].env_state = updates.store(msg.payload(), msg.length());
+          }
+          break;
+        case MSG_RESIDUAL:
+          // What compressing the client's update dropped, added to its next
+          {
+            int i = msg.header.job;
+
+            if (i < 0 || i >= (int) schedules.size())
+              throw runtime_error("Invalid schedule index");
+
+            if (schedules[i].residual >= 0)
+              updates.release(schedules[i].residual);
+
+            schedules[i].residual = updates.store(msg.payload(), msg.length());
+          }
+          break;
+        case MSG_GET_GLOBAL_MODEL:
+          // Send global model with the federation status, now or once the
+          // requested version arrives
+          {
+            if (msg.header.arg[0] > 0)
+            {
+              watchers[source] = msg.header;
+              break;
+            }
+
+            MessageHeader header = message_header(MSG_GLOBAL_MODEL);
+            header.arg[0] = F_time;
+            header.arg[1] = total_updates;
+            header.arg[2] = total_trajectories;
+
+            send_model(source, msg.header, header);
           }
           break;
         default:
           // Unknown message
           throw runtime_error("Unknown message");
       }
+
+      messages.recycle(msg);
+
+      if (!watchers.empty())
+        notify_watchers();
+    }
+
+    // Every job joining now is in; merge the sums of held updates, then
+    // apply time-step aggregates
+    if (!deferred.empty() && !stop_requested)
+      merge_deferred();
+
+    if (aggregator->end_time(F_time))
+    {
+      snapshot.bump();
+      total_updates++;
+    }
+
+    if (!watchers.empty())
+      notify_watchers();
+
+    metrics.flush();
+
+    log_debug("finished F_time = %d", F_time);
+  }
+
+  // Answer every remaining request with STOP until all ranks have stopped.
+  // Updates still in flight are discarded.
+  set<int> stopped;
+
+  // Sub-aggregators never ask; they drop what they hold
+  for (int sub : tree.sub_aggregators)
+  {
+    messages.send(sub, message_header(MSG_STOP));
+    stopped.insert(sub);
+  }
+
+  for (auto& watcher : watchers)
+  {
+    messages.send(watcher.first, message_header(MSG_STOP));
+    stopped.insert(watcher.first);
+  }
+
+  while ((int) stopped.size() < size - 1)
+  {
+    Message msg = messages.recv();
+
+    if (msg.header.type == MSG_GET_SCHEDULE || msg.header.type == MSG_GET_GLOBAL_MODEL)
+    {
+      messages.send(msg.source, message_header(MSG_STOP));
+      stopped.insert(msg.source);
     }
 
-    cout << "finished F_time = " << F_time << endl;
-    F_time += 1;
+    messages.recycle(msg);
   }
 
+  messages.flush();
+
   return 0;
 }
@@ -0,0 +1,215 @@
+/**
+ * @file sharedmodel.cpp
+ * @brief Global model versions shared by the ranks of a node
+ */
+
+#include "sharedmodel.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+// How long read() waits for a version before giving up on its publisher.
+// A publisher copies the model within milliseconds of receiving it.
+static const chrono::seconds READ_TIMEOUT(60);
+
+// Longest sleep between polls of the slots while waiting
+static const chrono::microseconds READ_MAX_BACKOFF(1000);
+
+std::vector<int> discover_nodes(MPI_Comm* node_comm)
+{
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  MPI_Comm comm;
+  if (MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &comm))
+    throw runtime_error("MPI_Comm_split_type failed");
+
+  // Name every node by its lowest rank
+  int node = rank;
+  MPI_Bcast(&node, 1, MPI_INT, 0, comm);
+
+  if (node_comm)
+    *node_comm = comm;
+  else
+    MPI_Comm_free(&comm);
+
+  vector<int> nodes(size);
+  MPI_Allgather(&node, 1, MPI_INT, nodes.data(), 1, MPI_INT, MPI_COMM_WORLD);
+
+  return nodes;
+}
+
+SharedModel::SharedModel(size_t capacity, bool enabled)
+  : enabled(enabled), capacity(capacity)
+{
+  if (!enabled)
+    return;
+
+  nodes = discover_nodes(&node_comm);
+
+  int rank, node_rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_rank(node_comm, &node_rank);
+
+  int node = nodes[rank];
+
+  // Slot headers stay cache line aligned
+  stride = (sizeof(SharedModelSlot) + capacity + 63) / 64 * 64;
+
+  // The node's lowest rank allocates, the others map its segment
+  char* local;
+  if (MPI_Win_allocate_shared(node_rank == 0 ? SLOTS * stride : 0, 1, MPI_INFO_NULL, node_comm, &local, &win))
+    throw runtime_error("MPI_Win_allocate_shared failed");
+
+  MPI_Aint segment;
+  int disp_unit;
+  if (MPI_Win_shared_query(win, 0, &segment, &disp_unit, &base))
+    throw runtime_error("MPI_Win_shared_query failed");
+
+  // Loads and stores go straight to memory; the slots synchronize them
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+  if (node_rank == 0)
+  {
+    for (int i = 0; i < SLOTS; i++)
+    {
+      SharedModelSlot* s = new (base + i * stride) SharedModelSlot;
+      s->seq.store(0);
+      s->version.store(-1);
+      s->bytes.store(0);
+    }
+  }
+
+  MPI_Win_sync(win);
+  MPI_Barrier(node_comm);
+  MPI_Win_sync(win);
+
+  log_debug("Sharing the global model with node %d (%zu bytes)", node, (size_t) segment);
+}
+
+SharedModel::~SharedModel()
+{
+  if (!enabled)
+    return;
+
+  // Freeing is collective; a rank unwinding an error would wait forever
+  if (uncaught_exceptions())
+    return;
+
+  MPI_Win_unlock_all(win);
+  MPI_Win_free(&win);
+  MPI_Comm_free(&node_comm);
+}
+
+void SharedModel::publish(int version, const char* data, size_t size)
+{
+  if (size > capacity)
+    throw runtime_error("model exceeds the shared window");
+
+  SharedModelSlot& s = slot(version % SLOTS);
+
+  // Take the slot from any other writer by making the sequence odd
+  uint64_t seq = s.seq.load(memory_order_relaxed);
+
+  while ((seq & 1) || !s.seq.compare_exchange_weak(seq, seq + 1, memory_order_acquire))
+  {
+    this_thread::yield();
+    seq = s.seq.load(memory_order_relaxed);
+  }
+
+  if (s.version.load(memory_order_relaxed) >= version)
+  {
+    // A newer version got here first; nothing changed
+    s.seq.store(seq, memory_order_release);
+    return;
+  }
+
+  atomic_thread_fence(memory_order_release);
+
+  s.version.store(version, memory_order_relaxed);
+  s.bytes.store(size, memory_order_relaxed);
+  memcpy(reinterpret_cast<char*>(&s) + sizeof(SharedModelSlot), data, size);
+
+  s.seq.store(seq + 2, memory_order_release);
+}
+
+int SharedModel::read(int version, const function<void(const char*, size_t)>& consume) const
+{
+  auto deadline = chrono::steady_clock::now() + READ_TIMEOUT;
+  chrono::microseconds backoff(0);
+
+  while (1)
+  {
+    // Newest complete slot at or past the version
+    int best = -1, best_version = version - 1;
+    uint64_t best_seq = 0;
+
+    for (int i = 0; i < SLOTS; i++)
+    {
+      uint64_t seq = slot(i).seq.load(memory_order_acquire);
+      int v = slot(i).version.load(memory_order_relaxed);
+
+      if (!(seq & 1) && v > best_version)
+      {
+        best = i;
+        best_version = v;
+        best_seq = seq;
+      }
+    }
+
+    if (best < 0)
+    {
+      // Its publisher has not written it yet: spin briefly, then back off
+      if (chrono::steady_clock::now() > deadline)
+        throw runtime_error("model version " + to_string(version) + " never reached the shared window");
+
+      if (backoff.count())
+        this_thread::sleep_for(backoff);
+      else
+        this_thread::yield();
+
+      backoff = min(max(2 * backoff, chrono::microseconds(1)), READ_MAX_BACKOFF);
+      continue;
+    }
+
+    SharedModelSlot& s = slot(best);
+    size_t size = s.bytes.load(memory_order_relaxed);
+
+    // Torn data can fail to parse; that only counts if nothing raced
+    bool failed = false;
+    exception_ptr error;
+
+    if (size <= capacity)
+    {
+      try {
+        consume(reinterpret_cast<const char*>(&s) + sizeof(SharedModelSlot), size);
+      } catch (...) {
+        failed = true;
+        error = current_exception();
+      }
+    } else {
+      failed = true;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if (s.seq.load(memory_order_relaxed) != best_seq)
+      continue;
+
+    if (error)
+      rethrow_exception(error);
+    if (failed)
+      throw runtime_error("corrupt shared model slot");
+
+    return best_version;
+  }
+}
@@ -0,0 +1,128 @@
+/**
+ * @file sharedmodel.h
+ * @brief Global model versions shared by the ranks of a node
+ */
+
+#ifndef AFDRL_SHAREDMODEL_H
+#define AFDRL_SHAREDMODEL_H
+
+#include <mpi.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/**
+ * Finds the node of every rank, named by the lowest rank on it. Collective
+ * over MPI_COMM_WORLD.
+ *
+ * @param node_comm Receives the communicator of this rank's node, to be
+ *        freed by the caller; if null, it is freed here.
+ * @return The node of every rank in MPI_COMM_WORLD.
+ */
+std::vector<int> discover_nodes(MPI_Comm* node_comm = nullptr);
+
+/**
+ * Header of a version slot in the shared window; the serialized model
+ * follows. seq is a sequence lock: odd while the slot is being written.
+ */
+struct alignas(64) SharedModelSlot
+{
+  std::atomic<uint64_t> seq;
+  std::atomic<int32_t> version; // model version held, -1 if none
+  std::atomic<uint64_t> bytes;  // serialized model size
+};
+
+/**
+ * Per-node copy of the global model in an MPI-3 shared memory window. For
+ * each version, one rank of the node publishes the serialized model it
+ * received from the scheduler; the other ranks of the node deserialize
+ * straight from the window instead of receiving their own copy.
+ *
+ * Versions alternate between two slots, so a version can be read while the
+ * next one is written. Readers validate what they consumed against the
+ * slot's sequence lock and retry on a concurrent write.
+ *
+ * Construction and destruction are collective over MPI_COMM_WORLD and must
+ * happen on the thread that makes MPI calls; publish() and read() make no
+ * MPI calls and are safe from any thread.
+ */
+class SharedModel
+{
+public:
+    /**
+     * Creates the node windows, or does nothing when disabled (on every
+     * rank alike).
+     *
+     * @param capacity Size of a serialized model in bytes.
+     * @param enabled Whether the model is shared through windows.
+     */
+    SharedModel(size_t capacity, bool enabled);
+
+    /**
+     * Frees the window.
+     */
+    ~SharedModel();
+
+    SharedModel(const SharedModel&) = delete;
+    SharedModel& operator=(const SharedModel&) = delete;
+
+    /**
+     * Get whether the model is shared through windows.
+     */
+    bool is_enabled() const { return enabled; }
+
+    /**
+     * Get the node of a rank, named by the lowest rank on it.
+     *
+     * @param rank The rank in MPI_COMM_WORLD.
+     * @return The node.
+     */
+    int get_node(int rank) const { return nodes[rank]; }
+
+    /**
+     * Writes a model version into the window, unless its slot already holds
+     * a newer one.
+     *
+     * @param version The model version.
+     * @param data The serialized model.
+     * @param size The serialized model size, at most the capacity.
+     */
+    void publish(int version, const char* data, size_t size);
+
+    /**
+     * Waits until the window holds the given version or a newer one, and
+     * hands the newest such model to consume. consume may be called again
+     * if a write raced with it, so it must overwrite all of its results.
+     * Throws if the version does not show up within a minute, which means
+     * its publisher failed.
+     *
+     * @param version The oldest acceptable version.
+     * @param consume Reads the serialized model.
+     * @return The version consumed.
+     */
+    int read(int version, const std::function<void(const char*, size_t)>& consume) const;
+
+private:
+    static const int SLOTS = 2;
+
+    SharedModelSlot& slot(int i) const { return *reinterpret_cast<SharedModelSlot*>(base + i * stride); }
+
+    bool enabled;
+
+    // Node of every rank
+    std::vector<int> nodes;
+
+    // Ranks of this node, and their window
+    MPI_Comm node_comm = MPI_COMM_NULL;
+    MPI_Win win = MPI_WIN_NULL;
+
+    // Start of the window, and bytes per slot
+    char* base = nullptr;
+    size_t stride = 0;
+    size_t capacity = 0;
+};
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file subaggregate.cpp
+ * @brief Node-local pre-reduction of client updates
+ */
+
+#include "subaggregate.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+#include <mpi.h>
+
+#include "codec.h"
+#include "messages.h"
+#include "model.h"
+#include "sharedmodel.h"
+#include "updatepool.h"
+
+using namespace std;
+
+bool AggregationTree::is_sub_aggregator(int rank) const
+{
+  return find(sub_aggregators.begin(), sub_aggregators.end(), rank) != sub_aggregators.end();
+}
+
+int AggregationTree::children(int rank) const
+{
+  return count(parent.begin(), parent.end(), rank);
+}
+
+AggregationTree make_aggregation_tree(int size, int test_ranks, bool enabled)
+{
+  AggregationTree tree;
+  tree.parent.assign(size, 0);
+
+  if (!enabled)
+    return tree;
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  vector<int> nodes = discover_nodes();
+
+  // Training ranks of every node, lowest first
+  map<int, vector<int>> trainers;
+  for (int r = test_ranks + 1; r < size; r++)
+    trainers[nodes[r]].push_back(r);
+
+  for (auto& entry : trainers)
+  {
+    // The scheduler's node reaches it without the network, and a lone
+    // trainer has nothing to combine with
+    if (entry.first == nodes[0] || entry.second.size() < 2)
+      continue;
+
+    int sub = entry.second[0];
+    tree.sub_aggregators.push_back(sub);
+
+    for (size_t i = 1; i < entry.second.size(); i++)
+      tree.parent[entry.second[i]] = sub;
+  }
+
+  if (rank == 0)
+    log_info("Aggregation tree with %zu sub-aggregators", tree.sub_aggregators.size());
+
+  return tree;
+}
+
+int sub_aggregate(int rank, int size, Args args, std::string rom_path, EnvConfig config, const AggregationTree& tree)
+{
+  // Model shape, for the schema and parameter segments of the sums
+  int channels, num_actions;
+  {
+    AtariEnv env(rom_path, config, -1, false);
+    channels = env.get_screen_channels();
+    num_actions = env.get_num_actions();
+  }
+
+  LSTMModel model(channels, num_actions);
+
+  if (args.flat_params)
+    model.flatten();
+
+  // Only collective here; the workers of this node read the model directly
+  SharedModel shared(sizeof(ModelHeader) + model.payload_bytes(), args.model_transport == "shared");
+
+  vector<int64_t> segments = model.segment_sizes();
+  uint64_t schema = model.schema_hash();
+
+  int64_t numel = 0;
+  for (int64_t n : segments)
+    numel += n;
+
+  torch::Tensor sum = torch::zeros({numel});
+
+  // Sums travel uncompressed, so the scheduler merges exactly what it would
+  // have merged one by one
+  UpdateEncoder encoder(CODEC_FP32, 0, false);
+
+  // Updates kept until the scheduler merges them, by client. A spill file is
+  // per process.
+  string spill = args.update_spill.empty() ? "" : args.update_spill + "." + to_string(rank);
+  UpdatePool updates((size_t) args.update_memory << 20, spill);
+  map<int, int> held;
+
+  log_info("Started sub-aggregator %d for %d training ranks", rank, tree.children(rank));
+
+  MessageLayer messages;
+
+  // Flush request waiting for updates still on their way
+  vector<SubAggregateEntry> request;
+  bool flushing = false;
+
+  bool stopped = false;
+  int stopped_children = 0;
+  int children = tree.children(rank);
+
+  while (!stopped || stopped_children < children)
+  {
+    Message msg = messages.recv();
+
+    switch (msg.header.type)
+    {
+      case MSG_UPDATE_GLOBAL_MODEL:
+        {
+          int client = msg.header.job;
+
+          if (held.count(client))
+            throw runtime_error("second update held for a client");
+
+          held[client] = updates.store(msg.payload(), msg.length());
+        }
+        break;
+      case MSG_FLUSH_UPDATES:
+        {
+          if (flushing)
+            throw runtime_error("overlapping flush requests");
+
+          request.resize(msg.header.arg[0]);
+
+          if (msg.length() != request.size() * sizeof(SubAggregateEntry))
+            throw runtime_error("corrupt flush request");
+
+          memcpy(request.data(), msg.payload(), msg.length());
+          flushing = true;
+        }
+        break;
+      case MSG_STOP:
+        // From the scheduler, then from each worker once it is done sending
+        if (msg.source == 0)
+          stopped = true;
+        else
+          stopped_children++;
+        break;
+      default:
+        throw runtime_error("Unknown message");
+    }
+
+    messages.recycle(msg);
+
+    if (!flushing || stopped)
+      continue;
+
+    bool ready = true;
+    for (auto& entry : request)
+      ready = ready && held.count(entry.client);
+
+    if (!ready)
+      continue;
+
+    // Weighted sum of the requested updates, in request order
+    sum.zero_();
+
+    for (auto& entry : request)
+    {
+      int handle = held[entry.client];
+
+      entry.bytes = updates.size(handle);
+      entry.norm = update_norm(updates.data(handle), entry.bytes);
+      apply_update(updates.data(handle), entry.bytes, sum, entry.weight, schema);
+
+      updates.release(handle);
+      held.erase(entry.client);
+    }
+
+    vector<char> encoded = encoder.encode(sum, segments, schema);
+
+    vector<char> payload(request.size() * sizeof(SubAggregateEntry) + encoded.size());
+    memcpy(payload.data(), request.data(), request.size() * sizeof(SubAggregateEntry));
+    memcpy(payload.data() + request.size() * sizeof(SubAggregateEntry), encoded.data(), encoded.size());
+
+    MessageHeader header = message_header(MSG_COMBINED_UPDATE);
+    header.arg[0] = request.size();
+    messages.send(0, header, std::move(payload));
+
+    log_debug("Combined %zu updates", request.size());
+
+    flushing = false;
+  }
+
+  messages.flush();
+
+  return 0;
+}
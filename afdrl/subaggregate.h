@@ -0,0 +1,79 @@
+/**
+ * @file subaggregate.h
+ * @brief Node-local pre-reduction of client updates
+ */
+
+#ifndef AFDRL_SUBAGGREGATE_H
+#define AFDRL_SUBAGGREGATE_H
+
+#include "args.h"
+#include "env.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A client update in a flush request (scheduler to sub-aggregator) and in
+ * the combined reply (sub-aggregator to scheduler).
+ */
+struct SubAggregateEntry
+{
+  int32_t client; // client (schedule) index
+  float weight;   // weight of the update in the sum (request)
+  uint64_t bytes; // encoded update size (reply)
+  double norm;    // norm of the decoded update (reply)
+};
+
+/**
+ * Where every rank sends its updates. Each node other than the scheduler's
+ * with at least two training ranks dedicates its lowest one to
+ * sub-aggregation; the other training ranks of the node send their updates
+ * to it, and everyone else to the scheduler.
+ */
+struct AggregationTree
+{
+    // Update destination of every rank (0 = the scheduler)
+    std::vector<int> parent;
+
+    // Sub-aggregator ranks
+    std::vector<int> sub_aggregators;
+
+    /**
+     * Get whether a rank is a sub-aggregator.
+     */
+    bool is_sub_aggregator(int rank) const;
+
+    /**
+     * Get the number of ranks sending their updates to a rank.
+     */
+    int children(int rank) const;
+};
+
+/**
+ * Lays out the aggregation tree. Collective over MPI_COMM_WORLD when
+ * enabled; otherwise every rank sends to the scheduler.
+ *
+ * @param size The size of the MPI communicator.
+ * @param test_ranks The number of tester ranks.
+ * @param enabled Whether to use sub-aggregators.
+ * @return The tree.
+ */
+AggregationTree make_aggregation_tree(int size, int test_ranks, bool enabled);
+
+/**
+ * Starts a sub-aggregator. It keeps the updates of its node's training
+ * ranks and, when the scheduler asks for a set of them, replies with their
+ * weighted sum as a single dense update.
+ *
+ * @param rank The rank of the sub-aggregator.
+ * @param size The size of the MPI communicator.
+ * @param args The configuration arguments.
+ * @param rom_path The ROM path.
+ * @param config The environment configuration.
+ * @param tree The aggregation tree.
+ * @return int The exit code.
+ */
+int sub_aggregate(int rank, int size, Args args, std::string rom_path, EnvConfig config, const AggregationTree& tree);
+
+#endif
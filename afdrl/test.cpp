@@ -1,117 +1,222 @@
 #include "test.h"
 #include "log.h"
 
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <mpi.h>
 #include <chrono>
 
 #include "torch_pch.h"
-#include "agent.h"
 #include "env.h"
+#include "inference.h"
 #include "messages.h"
 #include "model.h"
-
-#include <iomanip>
+#include "preprocess.h"
+#include "sharedmodel.h"
+#include "threadpool.h"
 
 using namespace std;
 
-int test(int rank, int size, Args args, std::string rom_path, EnvConfig config)
+/**
+ * Results of evaluating one model version.
+ */
+struct Evaluation
+{
+    int episodes = 0;
+    double mean = 0;
+    double std = 0;
+    double seconds = 0;
+};
+
+/**
+ * Plays one greedy episode per environment at once, each from its start
+ * state, so every version is scored on the same games. The environments
+ * are stepped on the thread pool, and each step is one batched forward over
+ * all of them.
+ *
+ * @param net The frozen model to evaluate, sized for every episode.
+ * @param pool Threads stepping the environments.
+ * @param envs The environments, reused across versions.
+ * @param starts The serialized start state of each environment.
+ * @param config The environment configuration.
+ * @return Evaluation The episode statistics.
+ */
+static Evaluation evaluate(InferenceModel& net, ThreadPool& pool, vector<unique_ptr<AtariEnv>>& envs,
+    const vector<vector<char>>& starts, const EnvConfig& config)
 {
-    // Testing environment
-    AtariEnv env(rom_path, config, -1, args.display_test);
+    auto start_time = chrono::steady_clock::now();
 
-    // Initialize the model.
-    LSTMModel model(
-        env.get_screen_channels(),
-        env.get_num_actions()
-    );
+    int K = envs.size();
+
+    vector<float> rewards(K, 0.0f);
+    vector<int> lengths(K, 0);
+    vector<char> alive(K, 1);
+
+    torch::Tensor states;
+    torch::Tensor actions;
+
+    int channels = envs[0]->get_screen_channels();
+    size_t state_bytes = (size_t) channels * OBS_PACKED;
+
+    states = torch::empty({K, channels, OBS_PACKED}, torch::kByte);
+
+    // Rewind every environment, random generator included, to its start
+    pool.run(K, [&](int i) {
+        envs[i]->deserialize(starts[i]);
+        memcpy(states[i].data_ptr(), envs[i]->get_state().data_ptr(), state_bytes);
+    });
+
+    net.reset_hidden();
+
+    int remaining = K;
 
-    if (args.gpu_id >= 0)
+    while (remaining > 0)
     {
-      model.to(torch::kCUDA);
+        // One forward for every episode; finished ones are simply ignored
+        actions = torch::argmax(net.step(states), 1).to(torch::kCPU);
+        const int64_t* action = actions.data_ptr<int64_t>();
+
+        pool.run(K, [&](int i) {
+            if (!alive[i])
+                return;
+
+            auto result = envs[i]->step(action[i]);
+
+            memcpy(states[i].data_ptr(), std::get<0>(result).data_ptr(), state_bytes);
+            rewards[i] += std::get<1>(result);
+            lengths[i]++;
+
+            if (std::get<2>(result) || (config.max_episode_length && lengths[i] >= config.max_episode_length))
+                alive[i] = 0;
+        });
+
+        remaining = 0;
+        for (int i = 0; i < K; i++)
+            remaining += alive[i];
     }
 
-    // Initialize the agent.
-    Agent agent(model, env, args);
+    Evaluation result;
+    result.episodes = K;
 
-    // Print a message indicating the testing loop started.
-    log_info("Started testing process");
+    for (float r : rewards)
+        result.mean += r;
+    result.mean /= K;
 
-    // Set an initial time stamp.
-    auto start_time = chrono::high_resolution_clock::now();
+    for (float r : rewards)
+        result.std += (r - result.mean) * (r - result.mean);
+    result.std = sqrt(result.std / K);
 
-    float reward_total_sum = 0, reward_sum = 0; // total reward and reward for the current episode
-    int num_tests = 0;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
 
-    while (1)
-    {
-        // Request the latest model parameters from the scheduler.
-        sendInt(0, rank);
-        sendInt(0, MSG_GET_GLOBAL_MODEL);
+    return result;
+}
 
-        // Expect the next received message to be the latest model parameters (or a stop message).
-        int recv_type = recvInt(0);
+int test(int rank, int size, Args args, std::string rom_path, EnvConfig config)
+{
+    if (args.test_episodes < 1)
+        throw runtime_error("need at least one test episode");
 
-        if (recv_type == MSG_STOP)
-            break;
+    // Testers split the model versions between them
+    int tester = rank - 1;
 
-        if (recv_type != MSG_GLOBAL_MODEL)
-            throw runtime_error("unexpected message type");
+    // Model shape
+    int channels, num_actions;
+    {
+        AtariEnv env(rom_path, config, -1, false);
+        channels = env.get_screen_channels();
+        num_actions = env.get_num_actions();
+    }
 
-        // Receive serialized model parameters from the scheduler.
-        std::vector<char> parameter_buf = recvBuffer(0);
-        agent.model.to(torch::kCPU);
-        agent.model.deserialize(parameter_buf);
-        agent.model.eval();
+    // Initialize the model.
+    LSTMModel model(channels, num_actions);
 
-        if (args.gpu_id >= 0)
-        {
-            agent.model.to(torch::kCUDA);
-        }
+    if (args.flat_params)
+      model.flatten();
 
-        // Receive federation status
-        int F_time = recvInt(0);
-        int update_count = recvInt(0);
-        int trajectories = recvInt(0);
+    // The model only receives parameters and stays on the CPU; episodes are
+    // played by a frozen, BatchNorm-folded copy on the device.
+    model.eval();
 
-        for (int step = 0; step < args.test_steps; ++step)
-        {
-          agent.action_test();
-          reward_sum += agent.reward;
+    InferenceModel net(args.test_episodes, args.gpu_id >= 0 ? torch::Device(torch::kCUDA) : torch::Device(torch::kCPU));
 
-          if (agent.done)
-          {
-            // Print the elapsed CPU time, episode length, total reward and mean reward.
-            auto end_time = chrono::high_resolution_clock::now();
-            auto elapsed_time = chrono::duration_cast<chrono::milliseconds>(end_time - start_time).count();
+    ThreadPool pool(args.test_threads);
 
-            num_tests++;
-            reward_total_sum += reward_sum;
-            float mean_reward = reward_total_sum / num_tests;
+    // Environment i is seeded with args.seed + i. Loading the ROMs is the
+    // slow part, so the environments are created once and every evaluation
+    // restarts them from a snapshot of their first reset.
+    int K = args.test_episodes;
 
-            log_info("F_time %d | eps len %d | reward %f | mean reward %f", F_time, agent.eps_len, reward_sum, mean_reward);
+    vector<unique_ptr<AtariEnv>> envs(K);
+    vector<vector<char>> starts(K);
 
-            // Print the elapsed CPU time in HH:MM:SS format, episode length, total reward and mean reward.
-            /*cout << "Elapsed time: " << setw(2) << elapsed_time / 1000 / 60 / 60 << ":" << setw(2) << elapsed_time / 1000 / 60 % 60 << ":" << setw(2) << elapsed_time / 1000 % 60 << " | ";
-            cout << "Episode length: " << agent.eps_len << " | ";
-            cout << "Total reward: " << reward_sum << " | ";
-            cout << "Mean reward: " << mean_reward << endl;*/
+    pool.run(K, [&](int i) {
+        envs[i].reset(new AtariEnv(rom_path, config, args.seed + i, args.display_test && i == 0));
+        envs[i]->reset();
+        starts[i] = envs[i]->serialize(true);
+    });
 
-            // Reset the environment.
-            agent.env.reset();
-            agent.clear_actions();
-            agent.done = false;
+    SharedModel shared(sizeof(ModelHeader) + model.payload_bytes(), args.model_transport == "shared");
 
-            agent.eps_len = 0;
-            reward_sum = 0;
+    // Print a message indicating the testing loop started.
+    log_info("Started testing process %d of %d", tester + 1, args.test_ranks);
 
-            // Sleep for 10 seconds.
-            this_thread::sleep_for(chrono::seconds(10));
+    MessageLayer messages;
 
+    // Global model version currently loaded (-1 if none yet)
+    int model_version = -1;
+
+    while (1)
+    {
+        // Ask for the next model version of ours. The scheduler holds the
+        // reply until it exists, so there is nothing to poll.
+        MessageHeader request = message_header(MSG_GET_GLOBAL_MODEL);
+        request.version = model_version;
+        request.arg[0] = args.test_ranks;
+        request.arg[1] = tester;
+        messages.send(0, request);
+
+        // Expect the reply to be the model parameters (or a stop message).
+        Message reply = messages.recv(0);
+
+        if (reply.header.type == MSG_STOP)
             break;
-          }
+
+        if (reply.header.type != MSG_GLOBAL_MODEL)
+            throw runtime_error("unexpected message type");
+
+        if (reply.header.model == MODEL_SHARED)
+        {
+            // Straight from the node's window; a newer version may be there
+            model_version = shared.read(reply.header.version, [&](const char* data, size_t size) {
+                model.deserialize(data, size);
+            });
+        } else {
+            if (!reply.length())
+                throw runtime_error("global model reply without a new version");
+
+            if (reply.header.model == MODEL_PUBLISH)
+                shared.publish(reply.header.version, reply.payload(), reply.length());
+
+            model.deserialize(reply.payload(), reply.length());
+            model_version = reply.header.version;
         }
+
+        // Federation status travels in the header
+        int F_time = reply.header.arg[0];
+        int update_count = reply.header.arg[1];
+
+        messages.recycle(reply);
+
+        // Refold for the new version
+        net.load(model, model_version);
+
+        Evaluation eval = evaluate(net, pool, envs, starts, config);
+
+        log_info("version %d | F_time %d | updates %d | episodes %d | reward %f +- %f | %.1f s",
+            model_version, F_time, update_count, eval.episodes, eval.mean, eval.std, eval.seconds);
     }
 
     return 0;
@@ -0,0 +1,165 @@
+/**
+ * @file test_preprocess.cpp
+ * @brief Checks that the preprocessing backends agree bit for bit
+ */
+
+#include "../preprocess.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+// ALE screen size, and the default 160x160 crop
+static const int SCREEN_WIDTH = 160;
+static const int SCREEN_HEIGHT = 210;
+static const int CROP_X = 0;
+static const int CROP_Y = 34;
+
+static const int SCREENS = 64;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, int screen)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "FAIL: %s (screen %d)\n", what, screen);
+    failures++;
+  }
+}
+
+/**
+ * Packs a binary observation one pixel at a time.
+ */
+static vector<uint8_t> pack_reference(const uint8_t* frame)
+{
+  vector<uint8_t> out(OBS_PACKED, 0);
+
+  for (int i = 0; i < OBS_SIZE * OBS_SIZE; i++)
+    if (frame[i])
+      out[i / 8] |= 1 << (i % 8);
+
+  return out;
+}
+
+/**
+ * The OpenCV backend of AtariEnv::preprocess().
+ */
+static vector<uint8_t> preprocess_opencv(const uint8_t* rgb)
+{
+  cv::Mat image(SCREEN_HEIGHT, SCREEN_WIDTH, CV_8UC3, const_cast<uint8_t*>(rgb));
+  cv::Mat gray, resized, binary;
+
+  cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
+  cv::Mat cropped = gray(cv::Rect(CROP_X, CROP_Y, 2 * OBS_SIZE, 2 * OBS_SIZE));
+  cv::resize(cropped, resized, cv::Size(OBS_SIZE, OBS_SIZE), cv::INTER_LINEAR);
+  cv::threshold(resized, binary, 128, 255, cv::THRESH_BINARY);
+
+  return pack_reference(binary.ptr<uint8_t>());
+}
+
+/**
+ * Runs every backend on random screens against the OpenCV output, with the
+ * vector kernels on or off.
+ */
+static void check_backends(mt19937& rng, bool simd)
+{
+  uniform_int_distribution<int> byte(0, 255);
+
+  // A random palette for the indexed screens
+  vector<uint8_t> palette(256 * 3);
+  for (auto& c : palette)
+    c = byte(rng);
+
+  uint8_t lut[256];
+  palette_gray_lut(palette.data(), lut);
+
+  vector<uint8_t> indexed(SCREEN_WIDTH * SCREEN_HEIGHT);
+  vector<uint8_t> rgb(indexed.size() * 3);
+  vector<uint8_t> fused(OBS_PACKED), palette_out(OBS_PACKED), from_palette(OBS_PACKED);
+
+  for (int s = 0; s < SCREENS; s++)
+  {
+    // An arbitrary RGB screen
+    for (auto& c : rgb)
+      c = byte(rng);
+
+    vector<uint8_t> expected = preprocess_opencv(rgb.data());
+    preprocess_rgb_fused(rgb.data(), SCREEN_WIDTH, CROP_X, CROP_Y, fused.data());
+    check(memcmp(fused.data(), expected.data(), OBS_PACKED) == 0, simd ? "fused (simd) vs opencv" : "fused (scalar) vs opencv", s);
+
+    // An indexed screen, and the same screen in RGB
+    for (auto& c : indexed)
+      c = byte(rng);
+
+    for (size_t i = 0; i < indexed.size(); i++)
+      memcpy(&rgb[i * 3], &palette[indexed[i] * 3], 3);
+
+    expected = preprocess_opencv(rgb.data());
+    preprocess_rgb_fused(rgb.data(), SCREEN_WIDTH, CROP_X, CROP_Y, from_palette.data());
+    preprocess_indexed_fused(indexed.data(), SCREEN_WIDTH, CROP_X, CROP_Y, lut, palette_out.data());
+    check(memcmp(from_palette.data(), expected.data(), OBS_PACKED) == 0, simd ? "fused (simd) vs opencv, palette screen" : "fused (scalar) vs opencv, palette screen", s);
+    check(memcmp(palette_out.data(), expected.data(), OBS_PACKED) == 0, "palette vs opencv", s);
+  }
+}
+
+/**
+ * Packs and unpacks random observations against the one-pixel-at-a-time
+ * reference, with the vector kernels on or off.
+ */
+static void check_pack(mt19937& rng, bool simd)
+{
+  bernoulli_distribution bit(0.5);
+
+  vector<uint8_t> frame(OBS_SIZE * OBS_SIZE), packed(OBS_PACKED);
+  vector<float> unpacked(OBS_SIZE * OBS_SIZE);
+
+  for (int s = 0; s < SCREENS; s++)
+  {
+    for (auto& p : frame)
+      p = bit(rng) ? 255 : 0;
+
+    pack_obs(frame.data(), packed.data());
+    check(packed == pack_reference(frame.data()), simd ? "pack_obs (simd)" : "pack_obs (scalar)", s);
+
+    unpack_obs(packed.data(), unpacked.data(), OBS_PACKED);
+
+    bool same = true;
+    for (size_t i = 0; i < frame.size(); i++)
+      same = same && unpacked[i] == (frame[i] ? 1.0f : 0.0f);
+
+    check(same, simd ? "unpack_obs (simd)" : "unpack_obs (scalar)", s);
+  }
+}
+
+int main()
+{
+  mt19937 rng(1);
+
+  bool simd = preprocess_use_simd(true);
+  printf("Vector kernels %s\n", simd ? "available" : "not available");
+
+  check_backends(rng, simd);
+  check_pack(rng, simd);
+
+  if (simd)
+  {
+    preprocess_use_simd(false);
+    check_backends(rng, false);
+    check_pack(rng, false);
+  }
+
+  if (failures)
+  {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file test_rollout.cpp
+ * @brief Checks that sequence mode learns from what the actor acted on
+ */
+
+#include "../agent.h"
+#include "../rollout.h"
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+// ctest's SKIP_RETURN_CODE, for hosts without the ROM
+static const int SKIPPED = 77;
+
+static const int ENVS = 4;
+static const int STEPS = 20;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, int step)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "FAIL: %s (step %d)\n", what, step);
+    failures++;
+  }
+}
+
+/**
+ * Acts for a full rollout, keeping a copy of the observations every step
+ * is taken in, and checks that the rollout recorded those same frames.
+ */
+static void check_frames(VecAgent& agent, RolloutBuffer& rollout)
+{
+  vector<torch::Tensor> observed;
+
+  rollout.clear();
+
+  while (!rollout.full())
+  {
+    observed.push_back(agent.state.clone());
+    agent.action_rollout(rollout);
+  }
+
+  // Frames are [T * N, C, OBS_PACKED], step-major
+  torch::Tensor frames = rollout.get_frames().view({rollout.size(), ENVS, -1});
+
+  for (int t = 0; t < rollout.size(); t++)
+    check(frames[t].equal(observed[t].view({ENVS, -1})), "rollout frames are the observations acted on", t);
+}
+
+/**
+ * Acts for a full rollout, keeping the logits every step sampled from, and
+ * checks that the learner's pass over the rollout reproduces them with the
+ * parameters unchanged.
+ */
+static void check_logits(VecAgent& agent, RolloutBuffer& rollout)
+{
+  vector<torch::Tensor> acted;
+
+  rollout.clear();
+
+  while (!rollout.full())
+  {
+    // The same train-mode forward action_rollout() runs on this batch
+    {
+      torch::InferenceMode guard;
+      auto output = agent.model.forward(torch::TensorList({LSTMModel::input(agent.state), agent.hx, agent.cx})).toTensorList();
+      acted.push_back(output.get(1).clone());
+    }
+
+    agent.action_rollout(rollout);
+  }
+
+  torch::NoGradGuard no_grad;
+
+  // The learner's pass, as in run_rollout_schedule()
+  int64_t T = rollout.size();
+  torch::Tensor features = agent.model.features(LSTMModel::input(rollout.get_frames()), T);
+  torch::Tensor logits = agent.model.actor_linear->forward(features).view({T, ENVS, -1});
+
+  for (int t = 0; t < T; t++)
+    check(logits[t].allclose(acted[t], 1e-4, 1e-5), "learner logits match the acting logits", t);
+}
+
+int main(int argc, char** argv)
+{
+  Args args(argc, argv);
+  args.num_envs = ENVS;
+  args.a3c_steps = STEPS;
+
+  // Same game and preprocessing as afdrl.cpp
+  EnvConfig config;
+  string rom_path = args.roms + "pong.bin";
+  config.crop_x = 0;
+  config.crop_y = 34;
+  config.crop_width = 160;
+  config.crop_height = 160;
+  config.frame_skip = 4;
+  config.frame_stack = 3;
+
+  if (!ifstream(rom_path))
+  {
+    printf("No ROM at %s, skipping\n", rom_path.c_str());
+    return SKIPPED;
+  }
+
+  torch::manual_seed(args.seed);
+
+  vector<int> seeds;
+  for (int i = 0; i < ENVS; i++)
+    seeds.push_back(args.seed + i);
+
+  VecAtariEnv envs(rom_path, config, seeds);
+
+  LSTMModel model(envs.get_screen_channels(), envs.get_num_actions());
+  model.train();
+
+  VecAgent agent(model, envs, args);
+  RolloutBuffer rollout(STEPS, ENVS, envs.get_screen_channels(), torch::kCPU);
+
+  check_frames(agent, rollout);
+  check_logits(agent, rollout);
+
+  if (failures)
+  {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file threadpool.cpp
+ * @brief Fixed-size pool of worker threads
+ */
+
+#include "threadpool.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+ThreadPool::ThreadPool(int threads)
+{
+  if (threads < 1)
+    throw runtime_error("thread pool needs at least one thread");
+
+  for (int i = 0; i < threads; i++)
+    workers.emplace_back(&ThreadPool::loop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+
+  ready.notify_all();
+
+  for (auto& worker : workers)
+    worker.join();
+}
+
+void ThreadPool::submit(function<void()> task)
+{
+  {
+    lock_guard<std::mutex> lock(queue_mutex);
+    tasks.push_back(std::move(task));
+  }
+
+  ready.notify_one();
+}
+
+void ThreadPool::wait()
+{
+  unique_lock<std::mutex> lock(queue_mutex);
+  idle.wait(lock, [this] { return tasks.empty() && active == 0; });
+
+  if (error)
+  {
+    exception_ptr e = error;
+    error = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+void ThreadPool::run(int n, const function<void(int)>& fn)
+{
+  for (int i = 0; i < n; i++)
+    submit([&fn, i] { fn(i); });
+
+  wait();
+}
+
+void ThreadPool::loop()
+{
+  while (1)
+  {
+    function<void()> task;
+
+    {
+      unique_lock<std::mutex> lock(queue_mutex);
+      ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+      if (tasks.empty())
+        break;
+
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      active++;
+    }
+
+    exception_ptr e;
+
+    try {
+      task();
+    } catch (...) {
+      e = current_exception();
+    }
+
+    {
+      lock_guard<std::mutex> lock(queue_mutex);
+      active--;
+
+      if (e && !error)
+        error = e;
+
+      if (tasks.empty() && active == 0)
+        idle.notify_all();
+    }
+  }
+}
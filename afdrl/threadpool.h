@@ -0,0 +1,75 @@
+/**
+ * @file threadpool.h
+ * @brief Fixed-size pool of worker threads
+ */
+
+#ifndef AFDRL_THREADPOOL_H
+#define AFDRL_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs submitted tasks on a fixed set of threads. An exception thrown by a
+ * task is kept and rethrown by the next wait().
+ */
+class ThreadPool
+{
+public:
+    /**
+     * Starts the threads.
+     *
+     * @param threads Number of threads (at least one).
+     */
+    explicit ThreadPool(int threads);
+
+    /**
+     * Finishes the queued tasks and joins the threads.
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * Queues a task.
+     */
+    void submit(std::function<void()> task);
+
+    /**
+     * Blocks until every submitted task has finished.
+     */
+    void wait();
+
+    /**
+     * Runs fn(0) ... fn(n - 1) on the pool and waits for all of them.
+     */
+    void run(int n, const std::function<void(int)>& fn);
+
+    int size() const { return workers.size(); }
+
+private:
+    /**
+     * Thread body.
+     */
+    void loop();
+
+    std::vector<std::thread> workers;
+
+    std::mutex queue_mutex;
+    std::condition_variable ready, idle;
+    std::deque<std::function<void()>> tasks;
+
+    // Tasks taken but not finished
+    int active = 0;
+    bool stopping = false;
+
+    std::exception_ptr error;
+};
+
+#endif
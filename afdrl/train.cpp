@@ -2,319 +2,823 @@
 #include "log.h"
 
 #include <c10/core/TensorOptions.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <iostream>
 #include <stdexcept>
-#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <mpi.h>
 
 #include "agent.h"
+#include "codec.h"
+#include "loss.h"
 #include "messages.h"
 #include "model.h"
+#include "optim.h"
+#include "resetpool.h"
+#include "sharedmodel.h"
+#include "rollout.h"
+#include "threadpool.h"
+#include "vecenv.h"
 
 #include "torch_pch.h"
 
 using namespace std;
 
-int train(int rank, int size, Args args, std::string rom_path, EnvConfig config)
+/**
+ * Runs a scheduled job on a vector of environments. Every step is a single
+ * batched forward over all environments, and each rollout is trained as one
+ * masked A2C update across the batch.
+ *
+ * @param agent The vectorized agent.
+ * @param optimizer The optimizer bound to the agent's model.
+ * @param schedule_length The number of environment steps to run.
+ * @param args The configuration arguments.
+ * @param rank The rank of the training process.
+ */
+static void run_vec_schedule(VecAgent& agent, torch::optim::Optimizer& optimizer, int schedule_length, const Args& args, int rank)
 {
-    // Initialize rolling entropy window and parameters
-    const int entropy_window_size = 100;
-    deque<float> entropy_window;
-    float entropy_avg = 0.0;
-    float min_entropy = 0.01f;
-    float ctr_entropy = 0.05f;
-    float max_entropy = 0.4f;
-    float entropy_slope = 20.0f;
-    
-    int rw = 0;
-
-    // Initialize local environment
-    AtariEnv env(rom_path, config, args.seed + rank, false); // should be false
-
-    LSTMModel model(
-        env.get_screen_channels(),
-        env.get_num_actions()
-    );
-
-    // Last client model, used to compute update difference
-    LSTMModel init_model(
-        env.get_screen_channels(),
-        env.get_num_actions()
-    );
-
-    if (args.gpu_id >= 0)
+    const float entropy_coef = 0.01f;
+
+    agent.clear_actions();
+
+    int total_steps = 0;
+    while (total_steps < schedule_length)
     {
-      model.to(torch::kCUDA);
-      init_model.to(torch::kCUDA);
-    }
+        // Truncate backpropagation at the rollout boundary.
+        agent.hx = agent.hx.detach();
+        agent.cx = agent.cx.detach();
 
-    // Initialize the agent.
-    Agent agent(model, env, args);
+        // Run the agent for a number of batched steps.
+        for (int i = 0; i < args.a3c_steps && total_steps < schedule_length; i++)
+        {
+            agent.action_train();
+            total_steps += agent.envs.size();
+        }
 
-    // Print a message indicating the training loop started.
-    log_debug("Started training process %d", rank);
+        // Bootstrap the discounted return from the current states.
+        torch::Tensor R;
+        {
+            torch::NoGradGuard no_grad;
+
+            auto st = agent.state;
+            if (args.gpu_id >= 0)
+                st = st.to(torch::kCUDA);
+
+            R = agent.model.forward(torch::TensorList({LSTMModel::input(st), agent.hx, agent.cx})).toTensorList().get(0).squeeze(1);
+        }
+
+        // Stack the rollout once and compute the losses in batched ops.
+        // Masks stop returns and advantages from leaking across episode
+        // boundaries.
+        RolloutLoss rollout = a3c_loss(
+            torch::stack(agent.log_probs).squeeze(2),
+            torch::stack(agent.values).squeeze(2),
+            torch::stack(agent.entropies),
+            torch::stack(agent.rewards),
+            torch::stack(agent.masks),
+            R, args.gamma, args.tau, entropy_coef
+        );
+
+        agent.model.clear_grad();
+        rollout.loss.backward();
+
+        // Clip the gradients.
+        agent.model.clip_grad_norm(40.0f);
+
+        // Update the model parameters.
+        optimizer.step();
+
+        // Clear the trajectory.
+        agent.clear_actions();
+
+        log_debug("train %d step %d loss p %f v %f ent %f", rank, total_steps, rollout.policy_loss.item<float>(), rollout.value_loss.item<float>(), rollout.entropy.item<float>());
+    }
+}
+
+/**
+ * Runs a scheduled job in sequence mode. Acting runs without autograd and
+ * only records observations, actions, rewards and masks; each update then
+ * recomputes the convolutional trunk over the whole rollout as one
+ * [T * N, C, 80, 80] batch.
+ *
+ * The actor and critic heads read the trunk features rather than the LSTM
+ * output, so the recurrent state does not enter the loss and the learner
+ * has nothing to unroll: acting alone carries hx and cx forward.
+ *
+ * @param agent The vectorized agent.
+ * @param rollout The rollout buffer, sized for args.a3c_steps steps.
+ * @param optimizer The optimizer bound to the agent's model.
+ * @param schedule_length The number of environment steps to run.
+ * @param args The configuration arguments.
+ * @param rank The rank of the training process.
+ */
+static void run_rollout_schedule(VecAgent& agent, RolloutBuffer& rollout, torch::optim::Optimizer& optimizer, int schedule_length, const Args& args, int rank)
+{
+    const float entropy_coef = 0.01f;
 
-    while (1)
+    int total_steps = 0;
+    while (total_steps < schedule_length)
     {
-        // Request a schedule from the scheduler.
-        sendInt(0, rank);
-        sendInt(0, MSG_GET_SCHEDULE);
+        rollout.clear();
+
+        // Act for a number of batched steps.
+        while (!rollout.full() && total_steps < schedule_length)
+        {
+            agent.action_rollout(rollout);
+            total_steps += agent.envs.size();
+        }
+
+        // Bootstrap the discounted return from the current states. The next
+        // rollout acts from this forward, so its first step samples from the
+        // parameters before the update below (see VecAgent::bootstrap()).
+        torch::Tensor R = agent.bootstrap();
+
+        int64_t T = rollout.size();
+        int64_t N = agent.envs.size();
+
+        // One trunk pass over every frame of the rollout, then both heads
+        // on the whole batch. Each step's frames are normalized on their
+        // own, as when acting, so the loss scores the policy that sampled
+        // the actions.
+        torch::Tensor features = agent.model.features(LSTMModel::input(rollout.get_frames()), T);
+
+        torch::Tensor values = agent.model.critic_linear->forward(features).view({T, N});
+        torch::Tensor logits = agent.model.actor_linear->forward(features).view({T, N, -1});
+
+        torch::Tensor prob = torch::softmax(logits, 2);
+        torch::Tensor log_prob = torch::log_softmax(logits, 2);
 
-        // Expect the next received message to be a schedule (or a stop message).
-        int recv_type = recvInt(0);
+        RolloutLoss loss = a3c_loss(
+            log_prob.gather(2, rollout.get_actions().unsqueeze(2)).squeeze(2),
+            values,
+            -(prob * log_prob).sum(2),
+            rollout.get_rewards(),
+            rollout.get_masks(),
+            R, args.gamma, args.tau, entropy_coef
+        );
 
-        if (recv_type == MSG_STOP)
-            break;
+        agent.model.clear_grad();
+        loss.loss.backward();
 
-        if (recv_type == MSG_SLEEP)
+        // Clip the gradients.
+        agent.model.clip_grad_norm(40.0f);
+
+        // Update the model parameters.
+        optimizer.step();
+
+        log_debug("train %d step %d loss p %f v %f ent %f", rank, total_steps, loss.policy_loss.item<float>(), loss.value_loss.item<float>(), loss.entropy.item<float>());
+    }
+}
+
+/**
+ * Runs a scheduled job on a single environment. Rollouts end early at
+ * episode boundaries.
+ *
+ * @param agent The agent.
+ * @param optimizer The optimizer bound to the agent's model.
+ * @param schedule_length The number of environment steps to run.
+ * @param args The configuration arguments.
+ * @param rank The rank of the training process.
+ */
+static void run_single_schedule(Agent& agent, torch::optim::Optimizer& optimizer, int schedule_length, const Args& args, int rank)
+{
+    const float entropy_coef = 0.01f;
+
+    // We will run some time with this model. We must clear the actions performed by the old model.
+    agent.clear_actions();
+
+    // Run the scheduled work
+    int total_steps = 0;
+    while (total_steps < schedule_length)
+    {
+        // Reset the hidden and cell states if the environment is done.
+        if (agent.done)
         {
-            // Sleep for a little, and try again
-            usleep(100000);
-            continue;
+            agent.hx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
+            agent.cx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
+        } else {
+            // Detach the hidden and cell states from the computation graph.
+            //agent.hx = agent.hx.detach();
+            //agent.cx = agent.cx.detach();
         }
 
-        if (recv_type != MSG_SCHEDULE)
-            throw runtime_error("unexpected message type");
-        
-        // Receive the schedule length
-        int schedule_length = recvInt(0);
-
-        // Receive the client index
-        int client_index = recvInt(0);
-
-        // Receive the model parameters
-        std::vector<char> parameter_buf = recvBuffer(0);
-        agent.model.to(torch::kCPU);
-        init_model.to(torch::kCPU);
-        agent.model.deserialize(parameter_buf);
-        init_model.deserialize(parameter_buf);
-
-        // Update the optimizer target parameters
-        //optimizer.param_groups()[0].params() = agent.model.parameters();
-        agent.model.train();
-
-        // Generic optimizer declaration
-        torch::optim::Optimizer* optimizer = nullptr;
-
-        // TODO: ideal if we can share this, but replacing param groups seems broken
-        // Initialize the optimizer.
-        /*torch::optim::Adam optimizer(
-            agent.model.parameters(),
-            torch::optim::AdamOptions(args.lr)
-        );*/
-
-        if (args.optimizer == "sgd")
+        // Move the model and the environment to the GPU if necessary.
+        if (args.gpu_id >= 0)
         {
-          optimizer = new torch::optim::SGD(
-            agent.model.parameters(),
-            torch::optim::SGDOptions(args.lr)
-          );
-        } else if (args.optimizer == "adam")
+            agent.hx = agent.hx.to(torch::kCUDA);
+            agent.cx = agent.cx.to(torch::kCUDA);
+        }
+
+        // Run the agent for a number of steps.
+        for (int i = 0; i < args.a3c_steps; i++)
         {
-          optimizer = new torch::optim::Adam(
-            agent.model.parameters(),
-            torch::optim::AdamOptions(args.lr)
-          );
-        } else if (args.optimizer == "rmsprop")
+            agent.action_train();
+            total_steps += 1;
+
+            agent.eps_reward += agent.reward;
+
+            if (agent.done)
+                break;
+        }
+
+        if (agent.done)
         {
-          optimizer = new torch::optim::RMSprop(
-            agent.model.parameters(),
-            torch::optim::RMSpropOptions(args.lr)
-          );
-        } else {
-          throw std::runtime_error("unknown optimizer");
+            agent.state = agent.env.reset();
+            log_debug("train %d terminated episode len %d rw %f", rank, agent.eps_len, agent.eps_reward);
+            agent.eps_len = 0;
+            agent.eps_reward = 0;
         }
 
-        if (args.gpu_id >= 0)
+        // Bootstrap the discounted return from the current state,
+        // unless the episode ended.
+        torch::Tensor R = torch::zeros({1});
+
+        if (!agent.done)
         {
-          agent.model.to(torch::kCUDA);
-          init_model.to(torch::kCUDA);
+            torch::NoGradGuard no_grad;
+            R = agent.model.forward(torch::TensorList({LSTMModel::input(agent.state.unsqueeze(0)), agent.hx, agent.cx})).toTensorList().get(0).view({1});
         }
 
-        log_debug("%d starting sched %d for %d steps", rank, client_index, schedule_length);
+        // Stack the rollout once and compute the losses in batched
+        // ops. The rollout never crosses an episode boundary.
+        int64_t T = agent.rewards.size();
+        torch::Tensor rewards = torch::from_blob(agent.rewards.data(), {T, 1}, torch::kFloat32);
 
-        // We will run some time with this model. We must clear the actions performed by the old model,
-        // as well as the hidden lstm states.
+        RolloutLoss rollout = a3c_loss(
+            torch::stack(agent.log_probs).view({T, 1}),
+            torch::stack(agent.values).view({T, 1}),
+            torch::stack(agent.entropies).view({T, 1}),
+            rewards,
+            torch::ones({T, 1}),
+            R, args.gamma, args.tau, entropy_coef
+        );
+
+        agent.model.clear_grad();
+        rollout.loss.backward();
+
+        // Check if the model params are leaves
+        if (!agent.model.parameters()[0].is_leaf())
+            throw runtime_error("model params are not leaves");
+
+        // Clip the gradients.
+        agent.model.clip_grad_norm(40.0f); // TODO: make this a parameter
+
+        // Update the model parameters.
+        optimizer.step();
+
+        // Clear the trajectory.
         agent.clear_actions();
-        agent.hx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-        agent.cx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
 
-        // TODO: the hidden states might need to be sent along side the models
+        log_debug("train %d step %d loss p %f v %f ent %f", rank, total_steps, rollout.policy_loss.item<float>(), rollout.value_loss.item<float>(), rollout.entropy.item<float>());
+    }
+}
 
-        // Run the scheduled work
-        int total_steps = 0;
-        while (total_steps < schedule_length)
+/**
+ * A scheduled client job handed to a worker.
+ */
+struct TrainJob
+{
+    int client;   // client index
+    int steps;    // environment steps to run
+    int version;  // global model version to start from
+
+    // Serialized global model of that version, or null to read it from the
+    // node's shared window
+    shared_ptr<const vector<char>> model;
+    const SharedModel* shared_model = nullptr;
+
+    // Client optimizer state, if the scheduler sent one
+    vector<char> optim_state;
+    bool has_optim_state = false;
+
+    // Where the client's episode stopped, if the scheduler sent it
+    vector<char> env_state;
+    bool has_env_state = false;
+
+    // What compressing the client's last update dropped, if anything
+    vector<char> residual;
+};
+
+/**
+ * What a finished job sends back to the scheduler.
+ */
+struct TrainResult
+{
+    int worker;
+    int client;
+    int version;              // global model version trained from
+    vector<char> delta;       // encoded update
+    vector<char> optim_state; // empty unless kept per client
+    vector<char> env_state;   // empty unless kept per client
+    vector<char> residual;    // empty without error feedback
+};
+
+/**
+ * Everything one job needs: environments, agent, models and optimizer. A
+ * rank runs one of these per worker thread.
+ */
+class TrainWorker
+{
+public:
+    /**
+     * Creates the worker's environments, models and optimizer.
+     *
+     * @param id Worker index within the rank.
+     * @param rank The rank of the training process.
+     * @param size The size of the MPI communicator.
+     * @param args The configuration arguments.
+     * @param rom_path The ROM path.
+     * @param config The environment configuration.
+     * @param encoder The rank's update encoder, shared by the workers.
+     * @param reset_pool The rank's episode start states, if any.
+     */
+    TrainWorker(int id, int rank, int size, const Args& args, const std::string& rom_path, const EnvConfig& config, const UpdateEncoder& encoder,
+        std::shared_ptr<const ResetPool> reset_pool)
+      : id(id), rank(rank), args(args), encoder(encoder),
+        worker_optimizer(args.optimizer, args.lr),
+        optim_state(parse_optim_state(args.optim_state))
+    {
+      if (args.env_state != "worker" && args.env_state != "client")
+          throw runtime_error("unknown env state policy: " + args.env_state);
+
+      client_env_state = args.env_state == "client";
+
+      // Initialize local environment(s). With more than one environment per
+      // worker, or in sequence mode, every step is a single batched forward
+      // over all of them. Worker 0 keeps the seeds of a single-worker rank.
+      if (args.rollout != "step" && args.rollout != "sequence")
+          throw runtime_error("unknown rollout mode: " + args.rollout);
+
+      bool sequence = args.rollout == "sequence";
+
+      int channels, num_actions;
+
+      if (args.num_envs > 1 || sequence)
+      {
+          vector<int> seeds;
+          for (int i = 0; i < args.num_envs; i++)
+              seeds.push_back(args.seed + rank + (id * args.num_envs + i) * size);
+
+          vec_env.reset(new VecAtariEnv(rom_path, config, seeds));
+
+          if (reset_pool)
+              vec_env->set_reset_pool(reset_pool);
+
+          channels = vec_env->get_screen_channels();
+          num_actions = vec_env->get_num_actions();
+      } else {
+          env.reset(new AtariEnv(rom_path, config, args.seed + rank + id * size, false)); // should be false
+
+          if (reset_pool)
+              env->set_reset_pool(reset_pool);
+
+          channels = env->get_screen_channels();
+          num_actions = env->get_num_actions();
+      }
+
+      model.reset(new LSTMModel(channels, num_actions));
+
+      // Last client model, used to compute update difference
+      init_model.reset(new LSTMModel(channels, num_actions));
+
+      if (args.flat_params)
+      {
+        model->flatten();
+        init_model->flatten();
+      }
+
+      if (args.gpu_id >= 0)
+      {
+        model->to(torch::kCUDA);
+        init_model->to(torch::kCUDA);
+      }
+
+      // Initialize the agent.
+      if (vec_env)
+          vec_agent.reset(new VecAgent(*model, *vec_env, args));
+      else
+          single_agent.reset(new Agent(*model, *env, args));
+
+      // Sequence mode records each rollout here, allocated once
+      if (sequence)
+          rollout.reset(new RolloutBuffer(args.a3c_steps, args.num_envs, channels,
+              args.gpu_id >= 0 ? torch::Device(torch::kCUDA) : torch::Device(torch::kCPU)));
+    }
+
+    /**
+     * Runs a job and encodes its update.
+     *
+     * @param job The job.
+     * @return TrainResult The messages for the scheduler.
+     */
+    TrainResult run(const TrainJob& job)
+    {
+      if (job.version != model_version)
+      {
+          // Load the new model version, in place on the models' device so
+          // the optimizer stays bound to them
+          if (job.model)
+          {
+              model->deserialize(*job.model);
+              init_model->deserialize(*job.model);
+              model_version = job.version;
+          } else {
+              // The window may already hold a newer version; train from that
+              model_version = job.shared_model->read(job.version, [&](const char* data, size_t size) {
+                  model->deserialize(data, size);
+                  init_model->deserialize(data, size);
+              });
+          }
+      }
+      else
+      {
+          // Unchanged global model: restart from the copy we already hold
+          model->copy_from(*init_model);
+      }
+
+      model->train();
+
+      // Bind the persistent optimizer. Parameters are only replaced if the
+      // model was re-flattened, in which case its state moves along.
+      torch::optim::Optimizer& optimizer = worker_optimizer.bind(*model);
+
+      if (job.has_optim_state)
+      {
+          worker_optimizer.import_state(job.optim_state.data(), job.optim_state.size(), model->schema_hash());
+      } else if (optim_state != OPTIM_STATE_WORKER) {
+          // Fresh state for this job, zeroed in place
+          worker_optimizer.reset();
+      }
+
+      // Pick up the client's episode where its last job stopped, start the
+      // first episode of a client, or keep this worker's episodes going with
+      // fresh hidden states.
+      if (job.has_env_state)
+      {
+          if (vec_agent)
+              vec_agent->load_state(job.env_state.data(), job.env_state.size());
+          else
+              single_agent->load_state(job.env_state.data(), job.env_state.size());
+      }
+      else if (client_env_state)
+      {
+          if (vec_agent)
+              vec_agent->reset_episode();
+          else
+              single_agent->reset_episode();
+      }
+      else if (vec_agent)
+      {
+          vec_agent->reset_hidden();
+      }
+      else
+      {
+          single_agent->hx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
+          single_agent->cx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
+      }
+
+      log_debug("%d.%d starting sched %d for %d steps", rank, id, job.client, job.steps);
+
+      if (rollout)
+          run_rollout_schedule(*vec_agent, *rollout, optimizer, job.steps, args, rank);
+      else if (vec_agent)
+          run_vec_schedule(*vec_agent, optimizer, job.steps, args, rank);
+      else
+          run_single_schedule(*single_agent, optimizer, job.steps, args, rank);
+
+      TrainResult result;
+      result.worker = id;
+      result.client = job.client;
+      result.version = model_version;
+
+      // Keep this client's optimizer state with the scheduler.
+      if (optim_state == OPTIM_STATE_CLIENT)
+          result.optim_state = worker_optimizer.export_state(model->schema_hash());
+
+      // And where its episode stopped.
+      if (client_env_state)
+          result.env_state = vec_agent ? vec_agent->save_state() : single_agent->save_state();
+
+      // Hack the agent model to find the delta
+      model->add(*init_model, -1.0f);
+
+      // The delta carries what the client's last update dropped, and the
+      // residual goes back to the scheduler for its next one
+      result.residual = job.residual;
+      result.delta = encoder.encode(
+          model->flat_data().to(torch::kCPU),
+          model->segment_sizes(),
+          model->schema_hash(),
+          &result.residual
+      );
+
+      return result;
+    }
+
+    /**
+     * Get the size of a serialized model.
+     */
+    size_t get_model_bytes() const { return sizeof(ModelHeader) + model->payload_bytes(); }
+
+private:
+    int id, rank;
+    const Args& args;
+    const UpdateEncoder& encoder;
+
+    unique_ptr<AtariEnv> env;
+    unique_ptr<VecAtariEnv> vec_env;
+
+    unique_ptr<LSTMModel> model, init_model;
+
+    // Global model version held by init_model (-1 if none yet)
+    int model_version = -1;
+
+    // Optimizer kept for the lifetime of the worker, with its state reset,
+    // kept, or loaded per client between jobs
+    WorkerOptimizer worker_optimizer;
+    OptimStatePolicy optim_state;
+
+    unique_ptr<Agent> single_agent;
+    unique_ptr<VecAgent> vec_agent;
+    unique_ptr<RolloutBuffer> rollout;
+
+    // Whether episodes travel with their clients
+    bool client_env_state;
+};
+
+int train(int rank, int size, Args args, std::string rom_path, EnvConfig config, const AggregationTree& tree)
+{
+    if (args.worker_threads < 1)
+        throw runtime_error("need at least one worker thread");
+
+    int num_workers = args.worker_threads;
+
+    // libtorch only has a process-wide intra-op setting; by default split the
+    // cores between the workers.
+    int intra_op = args.intra_op_threads;
+
+    if (!intra_op && num_workers > 1)
+        intra_op = max(1, (int) thread::hardware_concurrency() / num_workers);
+
+    if (intra_op)
+        torch::set_num_threads(intra_op);
+
+    // Update encoder; error feedback residuals travel with the jobs
+    UpdateEncoder encoder(parse_codec(args.codec), args.topk_ratio, args.error_feedback);
+
+    // Episode start states, shared read-only by every worker (and, through
+    // the pool file, by every rank of the node)
+    shared_ptr<const ResetPool> reset_pool;
+
+    if (args.reset_pool > 0)
+        reset_pool = make_shared<const ResetPool>(rom_path, config, args.reset_pool, args.reset_noops, args.seed, args.reset_pool_file);
+
+    vector<unique_ptr<TrainWorker>> workers;
+    for (int i = 0; i < num_workers; i++)
+        workers.emplace_back(new TrainWorker(i, rank, size, args, rom_path, config, encoder, reset_pool));
+
+    // Print a message indicating the training loop started.
+    log_debug("Started training process %d with %d workers", rank, num_workers);
+
+    // Node window for the global model, read by the workers
+    SharedModel shared(workers[0]->get_model_bytes(), args.model_transport == "shared");
+
+    // Only this thread talks MPI. Worker threads take jobs from it and hand
+    // back results through these.
+    std::mutex result_mutex;
+    std::condition_variable result_ready;
+    deque<TrainResult> results;
+    exception_ptr error;
+
+    // Declared after what its tasks use, so its threads are joined first
+    unique_ptr<ThreadPool> pool;
+    if (num_workers > 1)
+        pool.reset(new ThreadPool(num_workers));
+
+    vector<int> idle;
+    for (int i = num_workers - 1; i >= 0; i--)
+        idle.push_back(i);
+
+    MessageLayer messages;
+
+    // Where updates go (0 = the scheduler)
+    int parent = tree.parent[rank];
+
+    // Latest global model received, shared by the jobs that start from it
+    shared_ptr<const vector<char>> model_bytes;
+    int model_version = -1;
+
+    bool stopping = false;
+    bool requested = false;
+    auto sleep_until = chrono::steady_clock::now();
+
+    while (!stopping || (int) idle.size() < num_workers)
+    {
+        bool active = false;
+
+        // Send back finished jobs, unless the scheduler already stopped us
         {
-            // Reset the hidden and cell states if the environment is done.
-            if (agent.done)
+            deque<TrainResult> done;
             {
-                agent.hx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-                agent.cx = torch::zeros({1, 512}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-            } else {
-                // Detach the hidden and cell states from the computation graph.
-                //agent.hx = agent.hx.detach();
-                //agent.cx = agent.cx.detach();
-            }
+                lock_guard<std::mutex> lock(result_mutex);
+                done.swap(results);
 
-            // Move the model and the environment to the GPU if necessary.
-            if (args.gpu_id >= 0)
-            {
-                agent.hx = agent.hx.to(torch::kCUDA);
-                agent.cx = agent.cx.to(torch::kCUDA);
+                // A failed job ends the rank
+                if (error)
+                    rethrow_exception(error);
             }
 
-            // Run the agent for a number of steps.
-            for (int i = 0; i < args.a3c_steps; i++)
+            for (auto& result : done)
             {
-                agent.action_train();
-                total_steps += 1;
+                if (!stopping)
+                {
+                    if (!result.optim_state.empty())
+                        messages.send(0, message_header(MSG_OPTIM_STATE, result.client), std::move(result.optim_state));
 
-                rw += agent.reward;
+                    if (!result.env_state.empty())
+                        messages.send(0, message_header(MSG_CLIENT_STATE, result.client), std::move(result.env_state));
 
-                if (agent.done)
-                    break;
-            }
+                    if (!result.residual.empty())
+                        messages.send(0, message_header(MSG_RESIDUAL, result.client), std::move(result.residual));
 
-            if (agent.done)
-            {
-                agent.state = agent.env.reset();
-                log_debug("train %d terminated episode len %d rw %d", rank, agent.eps_len, rw);
-                agent.eps_len = 0;
-                rw = 0;
-            }
+                    // Send the encoded delta to the scheduler, or to our
+                    // sub-aggregator while telling the scheduler it is done
+                    MessageHeader update = message_header(MSG_UPDATE_GLOBAL_MODEL, result.client);
+                    update.version = result.version;
 
-            // Initialize the discounted return tensor.
-            torch::Tensor R = torch::zeros({1, 1}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-            //R = R.detach();
+                    if (parent)
+                    {
+                        messages.send(parent, update, std::move(result.delta));
 
-            torch::IValue result;
+                        update.arg[0] = 1;
+                        messages.send(0, update);
+                    } else {
+                        messages.send(0, update, std::move(result.delta));
+                    }
+                }
 
-            if (!agent.done)
-            {
-                // Compute the discounted return.
-                result = agent.model.forward(torch::TensorList({agent.state.unsqueeze(0), agent.hx, agent.cx}));
-                R = result.toTensorList().get(0).detach();
+                idle.push_back(result.worker);
+                active = true;
             }
+        }
 
-            // Move the discounted return tensor to the GPU if necessary.
-            if (args.gpu_id >= 0)
-                R = R.to(torch::kCUDA);
-
-            agent.values.push_back(R); // possibly no detach
+        messages.progress();
 
-            // might not need autograd variable
-            //torch::Tensor policy_loss = torch::autograd::Variable(torch::zeros({1}, torch::kFloat32));
-            //torch::Tensor value_loss = torch::autograd::Variable(torch::zeros({1}, torch::kFloat32));
-            //torch::Tensor gae = torch::autograd::Variable(torch::zeros({1}, torch::kFloat32));
+        // Request a schedule from the scheduler for an idle worker, naming the
+        // model version we already hold so it can be left out of the reply.
+        if (!stopping && !requested && !idle.empty() && chrono::steady_clock::now() >= sleep_until)
+        {
+            MessageHeader request = message_header(MSG_GET_SCHEDULE);
+            request.version = model_version;
+            messages.send(0, request);
+            requested = true;
+        }
 
-            torch::Tensor policy_loss = torch::zeros({1}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-            torch::Tensor value_loss = torch::zeros({1}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-            torch::Tensor gae = torch::zeros({1, 1}, torch::TensorOptions().requires_grad(true).dtype(torch::kFloat32));
-            torch::Tensor delta, log_prob, value, adv;
-            float total_entropy = 0;
+        // With a single worker there is nothing else to wait for
+        Message reply;
+        bool received = false;
 
-            if (args.gpu_id >= 0)
+        if (requested)
+        {
+            if (pool)
             {
-                R = R.to(torch::kCUDA);
-                policy_loss = policy_loss.to(torch::kCUDA);
-                value_loss = value_loss.to(torch::kCUDA);
-                gae = gae.to(torch::kCUDA);
+                received = messages.poll(reply, 0);
+            } else {
+                reply = messages.recv(0);
+                received = true;
             }
+        }
 
-            torch::Tensor advantage;
+        if (received)
+        {
+            requested = false;
+            active = true;
 
-            //R = R.detach(); // possibly no detach
+            // Expect the reply to be a schedule (or a stop/sleep message).
+            if (reply.header.type == MSG_STOP)
+            {
+                stopping = true;
+                messages.recycle(reply);
+                continue;
+            }
 
-            // Walk through the trajectory in reverse order.
-            for (int i = agent.rewards.size() - 1; i >= 0; i--)
+            if (reply.header.type == MSG_SLEEP)
             {
-                // Compute the discounted return.
-                R = args.gamma * R + agent.rewards[i];
-                advantage = R - agent.values[i];
-
-                // Compute the value loss.
-                value_loss = value_loss + 0.5 * advantage.pow(2);
-
-                // Compute the generalized advantage estimate.
-                delta = (
-                    agent.rewards[i]
-                    + args.gamma * agent.values[i + 1].data()
-                    - agent.values[i].data()
-                );
-                
-                gae = gae * args.gamma * args.tau + delta; // possibly no detach
-
-                policy_loss = policy_loss - agent.log_probs[i] * gae;
-
-                // Compute the entropy loss, first updating the rolling entropy average.
-                
-                float cur_entropy = agent.entropies[i].item<float>();
-                entropy_window.push_front(cur_entropy);
-                if (entropy_window.size() > entropy_window_size)
-                {
-                    float oldest_entropy = entropy_window.back();
-                    entropy_window.pop_back();
-                    entropy_avg += (cur_entropy - oldest_entropy) / entropy_window_size;
-                } else {
-                  // we'll have to compute the average from scratch
-                  entropy_avg = 0;
-                  for (auto it = entropy_window.begin(); it != entropy_window.end(); ++it)
-                    entropy_avg += *it;
-                  entropy_avg /= entropy_window.size();
-                }
+                // Sleep for a little, and try again
+                messages.recycle(reply);
+                sleep_until = chrono::steady_clock::now() + chrono::milliseconds(100);
+
+                if (num_workers == 1)
+                    this_thread::sleep_until(sleep_until);
 
-                float entropy_loss = ctr_entropy - entropy_slope * (cur_entropy - entropy_avg);
+                continue;
+            }
 
-                entropy_loss = max(min_entropy, entropy_loss);
-                entropy_loss = min(max_entropy, entropy_loss);
-                entropy_loss = 0.01f;
-                //std::cout << "entropy " << cur_entropy << " avg " << entropy_avg <<  " factor " << entropy_loss << std::endl;
-                //
-                total_entropy += agent.entropies[i].item<float>();
+            if (reply.header.type != MSG_SCHEDULE)
+                throw runtime_error("unexpected message type");
 
-                policy_loss = policy_loss - entropy_loss * agent.entropies[i];
+            // Schedule length and client index travel in the header
+            TrainJob job;
+            job.client = reply.header.job;
+            job.steps = reply.header.arg[0];
+            job.version = reply.header.version;
+
+            if (reply.header.model == MODEL_SHARED)
+            {
+                // The workers read this version from the node's window
+                model_bytes.reset();
+                model_version = reply.header.version;
+            }
+            else if (reply.length())
+            {
+                // First on the node to need it: share it before using it
+                if (reply.header.model == MODEL_PUBLISH)
+                    shared.publish(reply.header.version, reply.payload(), reply.length());
+
+                model_bytes = make_shared<const vector<char>>(reply.payload(), reply.payload() + reply.length());
+                model_version = reply.header.version;
+            }
+            else if (reply.header.version != model_version)
+            {
+                throw runtime_error("schedule without model for unknown version");
             }
 
-            // Zero the gradients.
-            //optimizer.zero_grad();
-            agent.model.zero_grad();
+            job.model = model_bytes;
+            job.shared_model = &shared;
 
-            // Backpropagate the loss.
-            torch::Tensor loss = policy_loss + 0.5f * value_loss;
-            loss.backward();
+            // The scheduler follows up with this client's optimizer state,
+            // episode and residual, if it holds them
+            job.has_optim_state = reply.header.arg[1] != 0;
+            job.has_env_state = reply.header.arg[2] != 0;
+            bool has_residual = reply.header.arg[3] != 0;
 
-            //std::cout << "policy_loss grad " << policy_loss.grad() << std::endl;
+            messages.recycle(reply);
 
-            // Check if the model params are leaves
-            if (!agent.model.parameters()[0].is_leaf())
-                throw runtime_error("model params are not leaves");
+            if (job.has_optim_state)
+            {
+                Message state = messages.recv(0, MSG_OPTIM_STATE);
+                job.optim_state.assign(state.payload(), state.payload() + state.length());
+                messages.recycle(state);
+            }
 
-            // Clip the gradients.
-            torch::nn::utils::clip_grad_norm_(agent.model.parameters(), 40.0f); // TODO: make this a parameter
+            if (job.has_env_state)
+            {
+                Message state = messages.recv(0, MSG_CLIENT_STATE);
+                job.env_state.assign(state.payload(), state.payload() + state.length());
+                messages.recycle(state);
+            }
 
-            // Update the model parameters.
-            optimizer->step();
+            if (has_residual)
+            {
+                Message state = messages.recv(0, MSG_RESIDUAL);
+                job.residual.assign(state.payload(), state.payload() + state.length());
+                messages.recycle(state);
+            }
 
-            // Clear the trajectory.
-            agent.clear_actions();
+            int worker = idle.back();
+            idle.pop_back();
 
-            log_debug("train %d step %d loss p %f v %f grad %f ent %f", rank, total_steps, policy_loss.sum().item<float>(), value_loss.sum().item<float>(), agent.model.parameters()[0].grad().sum().item<float>(), total_entropy);
-        }
+            if (!pool)
+            {
+                // Single worker: run the job on this thread
+                results.push_back(workers[worker]->run(job));
+                continue;
+            }
 
-        delete optimizer;
+            pool->submit([&, worker, job]() {
+                try {
+                    TrainResult result = workers[worker]->run(job);
 
-        // Send the updated model parameters to the scheduler.
-        sendInt(0, rank);
-        sendInt(0, MSG_UPDATE_GLOBAL_MODEL);
+                    lock_guard<std::mutex> lock(result_mutex);
+                    results.push_back(std::move(result));
+                } catch (...) {
+                    lock_guard<std::mutex> lock(result_mutex);
+                    error = current_exception();
+                }
 
-        // Hack the agent model to find the delta
-        agent.model.add(init_model, -1.0f);
+                result_ready.notify_one();
+            });
+        }
 
-        agent.model.to(torch::kCPU);
-        std::vector<char> delta_params = agent.model.serialize();
-        sendInt(0, client_index);
-        sendBuffer(0, delta_params);
+        if (!active && pool)
+        {
+            // Nothing to do until a job finishes or a message arrives
+            unique_lock<std::mutex> lock(result_mutex);
+            result_ready.wait_for(lock, chrono::milliseconds(1), [&] { return !results.empty() || error; });
+        }
     }
 
+    // Our sub-aggregator waits until every worker rank is done sending
+    if (parent)
+        messages.send(parent, message_header(MSG_STOP));
+
+    messages.flush();
+
     return 0;
 }
@@ -8,6 +8,7 @@
 
 #include "args.h"
 #include "env.h"
+#include "subaggregate.h"
 
 /**
  * Starts a training client.
@@ -15,8 +16,9 @@
  * @param rank The rank of the client.
  * @param size The size of the MPI communicator. 
  * @param args The configuration arguments.
+ * @param tree The aggregation tree.
  * @return int The exit code.
  */
-int train(int rank, int size, Args args, std::string rom_path, EnvConfig config);
+int train(int rank, int size, Args args, std::string rom_path, EnvConfig config, const AggregationTree& tree);
 
 #endif
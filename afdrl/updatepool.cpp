@@ -0,0 +1,260 @@
+/**
+ * @file updatepool.cpp
+ * @brief Bounded storage for encoded client updates
+ */
+
+#include "updatepool.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Spill extents are page aligned so a single update never shares a page
+static const size_t SPILL_ALIGN = 4096;
+
+// Largest ratio of a reused buffer's capacity to the update stored in it
+static const size_t REUSE_SLACK = 2;
+
+UpdatePool::UpdatePool(size_t memory_limit, const std::string& spill_path)
+  : memory_limit(memory_limit), spill_path(spill_path)
+{
+  if (spill_path.empty())
+    return;
+
+  spill_fd = open(spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+  if (spill_fd < 0)
+    throw runtime_error("could not open update spill file " + spill_path);
+
+  // The file only backs this process; drop the name right away.
+  unlink(spill_path.c_str());
+}
+
+UpdatePool::~UpdatePool()
+{
+  if (spill_map)
+    munmap(spill_map, spill_size);
+
+  if (spill_fd >= 0)
+    close(spill_fd);
+}
+
+int UpdatePool::store(const char* data, size_t size)
+{
+  int handle;
+
+  if (free_entries.empty())
+  {
+    handle = entries.size();
+    entries.emplace_back();
+  } else {
+    handle = free_entries.back();
+    free_entries.pop_back();
+  }
+
+  Entry& entry = entries[handle];
+  entry.used = true;
+  entry.size = size;
+
+  // A reused buffer is already charged to the budget. A new one must fit
+  // next to everything else, dropping released buffers to make room.
+  entry.memory = take_buffer(size);
+
+  bool fits = entry.memory.capacity() >= size;
+
+  if (!fits)
+  {
+    while (memory_limit && !free_buffers.empty() && memory_used + memory_cached + size > memory_limit)
+    {
+      auto largest = std::prev(free_buffers.end());
+      memory_cached -= largest->first;
+      free_buffers.erase(largest);
+    }
+
+    fits = !memory_limit || memory_used + memory_cached + size <= memory_limit;
+  }
+
+  if (fits)
+  {
+    entry.memory.assign(data, data + size);
+    entry.spilled = false;
+    memory_used += entry.memory.capacity();
+
+    return handle;
+  }
+
+  if (spill_fd < 0)
+  {
+    release(handle);
+    throw runtime_error("update pool memory limit reached and no spill file configured");
+  }
+
+  entry.offset = spill_alloc(size);
+  entry.spilled = true;
+  memcpy(spill_map + entry.offset, data, size);
+  spill_used += size;
+
+  log_debug("Spilled %zu byte update to %s", size, spill_path.c_str());
+
+  return handle;
+}
+
+const char* UpdatePool::data(int handle) const
+{
+  const Entry& entry = entries.at(handle);
+
+  if (!entry.used)
+    throw runtime_error("access to released update");
+
+  return entry.spilled ? spill_map + entry.offset : entry.memory.data();
+}
+
+size_t UpdatePool::size(int handle) const
+{
+  return entries.at(handle).size;
+}
+
+void UpdatePool::release(int handle)
+{
+  Entry& entry = entries.at(handle);
+
+  if (!entry.used)
+    throw runtime_error("update released twice");
+
+  if (entry.spilled)
+  {
+    spill_free(entry.offset, entry.size);
+    spill_used -= entry.size;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // Give the pages and disk blocks back instead of writing them out
+    size_t length = (entry.size + SPILL_ALIGN - 1) / SPILL_ALIGN * SPILL_ALIGN;
+    fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, entry.offset, length);
+#endif
+  } else {
+    // Keep the buffer for reuse; it stays charged to the budget
+    size_t capacity = entry.memory.capacity();
+
+    memory_used -= capacity;
+
+    if (capacity)
+    {
+      memory_cached += capacity;
+      free_buffers.emplace(capacity, std::move(entry.memory));
+    }
+
+    entry.memory = vector<char>();
+  }
+
+  entry.used = false;
+  entry.spilled = false;
+  entry.size = 0;
+  free_entries.push_back(handle);
+}
+
+vector<char> UpdatePool::take_buffer(size_t size)
+{
+  // Best fit: the smallest released buffer at least as large
+  auto it = free_buffers.lower_bound(size);
+
+  if (it == free_buffers.end() || it->first > max(size, (size_t) 1) * REUSE_SLACK)
+    return vector<char>();
+
+  vector<char> buffer = std::move(it->second);
+  memory_cached -= it->first;
+  free_buffers.erase(it);
+
+  return buffer;
+}
+
+size_t UpdatePool::spill_alloc(size_t size)
+{
+  size = (size + SPILL_ALIGN - 1) / SPILL_ALIGN * SPILL_ALIGN;
+
+  // First fit among released extents
+  for (auto it = spill_holes.begin(); it != spill_holes.end(); ++it)
+  {
+    if (it->second < size)
+      continue;
+
+    size_t offset = it->first;
+    size_t remaining = it->second - size;
+
+    spill_holes.erase(it);
+
+    if (remaining)
+      spill_holes[offset + size] = remaining;
+
+    return offset;
+  }
+
+  size_t offset = spill_end;
+  spill_end += size;
+
+  if (spill_end > spill_size)
+    spill_grow(spill_end);
+
+  return offset;
+}
+
+void UpdatePool::spill_free(size_t offset, size_t size)
+{
+  size = (size + SPILL_ALIGN - 1) / SPILL_ALIGN * SPILL_ALIGN;
+
+  auto next = spill_holes.lower_bound(offset);
+
+  // Merge with the following hole
+  if (next != spill_holes.end() && offset + size == next->first)
+  {
+    size += next->second;
+    next = spill_holes.erase(next);
+  }
+
+  // Merge with the preceding hole
+  if (next != spill_holes.begin())
+  {
+    auto prev = std::prev(next);
+
+    if (prev->first + prev->second == offset)
+    {
+      prev->second += size;
+      return;
+    }
+  }
+
+  spill_holes[offset] = size;
+}
+
+void UpdatePool::spill_grow(size_t size)
+{
+  // Grow geometrically to keep remaps rare
+  size_t new_size = spill_size ? spill_size : size;
+  while (new_size < size)
+    new_size *= 2;
+
+  if (ftruncate(spill_fd, new_size))
+    throw runtime_error("could not grow update spill file");
+
+  if (spill_map)
+    munmap(spill_map, spill_size);
+
+  void* map = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd, 0);
+
+  if (map == MAP_FAILED)
+  {
+    spill_map = nullptr;
+    spill_size = 0;
+    throw runtime_error("could not map update spill file");
+  }
+
+  spill_map = (char*) map;
+  spill_size = new_size;
+}
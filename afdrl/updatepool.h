@@ -0,0 +1,137 @@
+/**
+ * @file updatepool.h
+ * @brief Bounded storage for encoded client updates
+ */
+
+#ifndef AFDRL_UPDATEPOOL_H
+#define AFDRL_UPDATEPOOL_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Holds the encoded updates of clients that finished before their join
+ * time. Updates live in recycled memory buffers up to a byte budget that
+ * covers both the buffers in use and the released ones kept for reuse; past
+ * the budget they spill into a memory-mapped file, or storing fails when no
+ * spill file is configured.
+ */
+class UpdatePool {
+public:
+    /**
+     * Constructs an update pool.
+     *
+     * @param memory_limit Bytes of updates kept in memory (0 = no limit).
+     * @param spill_path File backing updates past the limit (empty = none).
+     */
+    UpdatePool(size_t memory_limit, const std::string& spill_path);
+
+    /**
+     * Unmaps and closes the spill file.
+     */
+    ~UpdatePool();
+
+    UpdatePool(const UpdatePool&) = delete;
+    UpdatePool& operator=(const UpdatePool&) = delete;
+
+    /**
+     * Stores a copy of an update.
+     *
+     * @param data The encoded update.
+     * @param size The update size in bytes.
+     * @return A handle to the stored update.
+     */
+    int store(const char* data, size_t size);
+
+    /**
+     * Get a stored update. The pointer is valid until the next store().
+     *
+     * @param handle The update handle.
+     * @return The update bytes.
+     */
+    const char* data(int handle) const;
+
+    /**
+     * Get the size of a stored update.
+     *
+     * @param handle The update handle.
+     * @return The update size in bytes.
+     */
+    size_t size(int handle) const;
+
+    /**
+     * Releases an update, making its storage available again.
+     *
+     * @param handle The update handle.
+     */
+    void release(int handle);
+
+    /**
+     * Get the bytes of updates held in memory.
+     */
+    size_t get_memory_bytes() const { return memory_used; }
+
+    /**
+     * Get the bytes of updates held in the spill file.
+     */
+    size_t get_spilled_bytes() const { return spill_used; }
+
+private:
+    /**
+     * A stored update, in memory or at an offset of the spill file.
+     */
+    struct Entry {
+      bool used = false;
+      bool spilled = false;
+      size_t size = 0;
+      size_t offset = 0;
+      std::vector<char> memory;
+    };
+
+    /**
+     * Reserves a spill file extent, growing the file if needed.
+     */
+    size_t spill_alloc(size_t size);
+
+    /**
+     * Returns a spill file extent, merging it with free neighbours.
+     */
+    void spill_free(size_t offset, size_t size);
+
+    /**
+     * Grows the spill file and its mapping to at least the given size.
+     */
+    void spill_grow(size_t size);
+
+    /**
+     * Takes a released buffer that fits a size without wasting much of it,
+     * or an empty one.
+     */
+    std::vector<char> take_buffer(size_t size);
+
+    std::vector<Entry> entries;
+    std::vector<int> free_entries;
+
+    // Released memory buffers by capacity, reused by later updates
+    std::multimap<size_t, std::vector<char>> free_buffers;
+
+    // Budget, and capacity of the buffers in use and of the released ones
+    size_t memory_limit;
+    size_t memory_used = 0;
+    size_t memory_cached = 0;
+
+    // Spill file state
+    std::string spill_path;
+    int spill_fd = -1;
+    char* spill_map = nullptr;
+    size_t spill_size = 0; // mapped (and file) size
+    size_t spill_end = 0;  // end of the highest extent ever allocated
+    size_t spill_used = 0;
+
+    // Free spill extents below spill_end, offset -> size
+    std::map<size_t, size_t> spill_holes;
+};
+
+#endif
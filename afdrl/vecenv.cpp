@@ -0,0 +1,72 @@
+/**
+ * @file vecenv.cpp
+ * @brief Vectorized environment interface
+ */
+
+#include "vecenv.h"
+#include "preprocess.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+VecAtariEnv::VecAtariEnv(const std::string& rom_path, EnvConfig config, const std::vector<int>& seeds)
+{
+  if (seeds.empty())
+    throw runtime_error("VecAtariEnv requires at least one environment");
+
+  for (int seed : seeds)
+    envs.emplace_back(new AtariEnv(rom_path, config, seed, false));
+
+  states = torch::empty({size(), config.frame_stack, OBS_PACKED}, torch::kByte);
+}
+
+torch::Tensor VecAtariEnv::reset()
+{
+  for (int i = 0; i < size(); i++)
+    states[i].copy_(envs[i]->reset());
+
+  return states;
+}
+
+void VecAtariEnv::set_reset_pool(std::shared_ptr<const ResetPool> pool)
+{
+  for (auto& env : envs)
+    env->set_reset_pool(pool);
+}
+
+torch::Tensor VecAtariEnv::sync()
+{
+  for (int i = 0; i < size(); i++)
+    states[i].copy_(envs[i]->get_state());
+
+  return states;
+}
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> VecAtariEnv::step(const std::vector<int>& actions)
+{
+  if ((int) actions.size() != size())
+    throw runtime_error("VecAtariEnv::step action count mismatch");
+
+  torch::Tensor rewards = torch::empty({size()}, torch::kFloat);
+  torch::Tensor dones = torch::empty({size()}, torch::kBool);
+
+  auto rewards_a = rewards.accessor<float, 1>();
+  auto dones_a = dones.accessor<bool, 1>();
+
+  for (int i = 0; i < size(); i++)
+  {
+    auto result = envs[i]->step(actions[i]);
+
+    rewards_a[i] = std::get<1>(result);
+    dones_a[i] = std::get<2>(result);
+
+    // Start a new episode right away so the batch stays full.
+    if (dones_a[i])
+      states[i].copy_(envs[i]->reset());
+    else
+      states[i].copy_(std::get<0>(result));
+  }
+
+  return std::make_tuple(states, rewards, dones);
+}
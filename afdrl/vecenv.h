@@ -0,0 +1,107 @@
+/**
+ * @file vecenv.h
+ * @brief Vectorized environment interface
+ */
+
+#ifndef AFDRL_VECENV_H
+#define AFDRL_VECENV_H
+
+#include "torch_pch.h"
+#include "env.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * This class owns several independent ALE environments and steps them
+ * together, so that a single batched model forward can drive all of them.
+ *
+ * Each environment is reset independently as soon as its episode ends.
+ */
+class VecAtariEnv {
+public:
+    /**
+     * Constructs a vector of Atari environments.
+     *
+     * @param rom_path The path to the ROM file.
+     * @param config The environment configuration.
+     * @param seeds One random seed per environment (-1 = time based).
+     */
+    VecAtariEnv(const std::string& rom_path, EnvConfig config, const std::vector<int>& seeds);
+
+    /**
+     * Resets every environment.
+     *
+     * Like AtariEnv, states are uint8 frames held in a buffer owned by the
+     * vector env and rewritten by the next reset() or step().
+     *
+     * @return The initial states, shaped [N, C, OBS_PACKED].
+     */
+    torch::Tensor reset();
+
+    /**
+     * Steps every environment with its own action.
+     *
+     * Environments reaching a terminal state are reset immediately, and their
+     * row in the returned state holds the first observation of the new episode.
+     *
+     * @param actions One action per environment.
+     * @return The next states [N, C, OBS_PACKED], rewards [N] and terminal flags [N].
+     */
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> step(const std::vector<int>& actions);
+
+    /**
+     * Re-reads the current state of every environment, after some of them
+     * were restored with AtariEnv::deserialize().
+     *
+     * @return The current states [N, C, OBS_PACKED].
+     */
+    torch::Tensor sync();
+
+    /**
+     * Starts every following episode of every environment from a state of a
+     * shared pool (see AtariEnv::set_reset_pool()).
+     *
+     * @param pool The reset pool.
+     */
+    void set_reset_pool(std::shared_ptr<const ResetPool> pool);
+
+    /**
+     * Get the number of environments.
+     *
+     * @return The number of environments.
+     */
+    int size() const { return envs.size(); }
+
+    /**
+     * Get a single environment.
+     *
+     * @param i The environment index.
+     * @return The environment.
+     */
+    AtariEnv& get(int i) { return *envs[i]; }
+
+    /**
+     * Get the number of actions.
+     *
+     * @return The number of actions.
+     */
+    int get_num_actions() const { return envs[0]->get_num_actions(); }
+
+    /**
+     * Get the screen channels.
+     *
+     * @return The screen channels.
+     */
+    int get_screen_channels() const { return envs[0]->get_screen_channels(); }
+
+private:
+    // Environments
+    std::vector<std::unique_ptr<AtariEnv>> envs;
+
+    // Batched uint8 states
+    torch::Tensor states;
+};
+
+#endif